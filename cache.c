@@ -0,0 +1,620 @@
+/* Copyright 2023 Shaqeel Ahmad
+ *
+ * This file is part of swiv.
+ *
+ * swiv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * swiv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with swiv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "swiv.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the packed cache consists of a data file, to which records of a path, the
+ * size and mtime of the file and the cached data are only appended, and an
+ * index file with a hash table of the offsets of the latest record of every
+ * path. Records, which were replaced, are dropped by cache_compact(), which
+ * writes both files anew.
+ *
+ * Both files are mapped and shared by all processes: appends are serialized by
+ * a lock on the data file, lookups only check the records they find. The data
+ * file is mapped with room to grow, so that the returned pointers stay valid;
+ * the mappings of files replaced by a compaction are kept as well.
+ */
+
+enum {
+	PACK_ALIGN   = 16,
+	PACK_SLOTS   = 1 << 12,  /* initial size of the index */
+	PACK_COMPACT = 64 << 20  /* bytes of dead records to compact at startup */
+};
+
+#define PACK_MAP ((uint64_t) 1 << (sizeof(size_t) > 4 ? 36 : 28))
+#define ALIGNED(n) (((uint64_t) (n) + PACK_ALIGN - 1) & ~(uint64_t) (PACK_ALIGN - 1))
+
+static const char data_magic[8] = "swivpak1";
+static const char index_magic[8] = "swividx1";
+static const uint32_t record_magic = 0x5357aa01;
+
+/* followed by the path and the data, both aligned to PACK_ALIGN */
+typedef struct {
+	uint64_t size;     /* of the file */
+	int64_t mtime;
+	uint64_t len;      /* of the data */
+	uint32_t pathlen;  /* including the null byte */
+	uint32_t magic;
+} record_t;
+
+typedef struct {
+	uint64_t hash;
+	uint64_t off;      /* of the record, 0 if the slot is empty */
+} slot_t;
+
+/* followed by the slots */
+typedef struct {
+	char magic[8];
+	uint64_t slots;    /* a power of 2, at most half of them are used */
+	uint64_t used;
+	uint64_t dead;     /* bytes of replaced records */
+} index_t;
+
+static struct {
+	pthread_rwlock_t lock;
+	char *dpath;
+	char *ipath;
+	int fd;            /* of the data file */
+	dev_t dev;
+	ino_t dino;
+	ino_t iino;
+	const char *data;  /* PACK_MAP bytes */
+	uint64_t dlen;     /* bytes known to be in the data file */
+	index_t *index;
+	size_t isize;
+	const char **old;  /* mappings of replaced data files */
+	int oldcnt;
+} pack = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+	.fd = -1
+};
+
+static uint64_t pack_hash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *s != '\0'; s++)
+		h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+	return h;
+}
+
+static slot_t* pack_slots(index_t *index)
+{
+	return (slot_t*) (index + 1);
+}
+
+static uint64_t rec_size(const record_t *r)
+{
+	return ALIGNED(sizeof(record_t) + r->pathlen) + ALIGNED(r->len);
+}
+
+static bool pack_lock(int fd, short type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	while (fcntl(fd, F_SETLKW, &fl) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+	return true;
+}
+
+static bool pack_write(int fd, const void *buf, uint64_t len, uint64_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pwrite(fd, buf, len, off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf = (const char*) buf + n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+/* checks, if the first end bytes of the data file can be read */
+static bool pack_valid(uint64_t end)
+{
+	struct stat st;
+
+	return end <= pack.dlen || (end <= PACK_MAP &&
+	       fstat(pack.fd, &st) == 0 && end <= (uint64_t) st.st_size);
+}
+
+/* the complete record at off, NULL if there is none */
+static const record_t* pack_record(uint64_t off)
+{
+	const record_t *r;
+
+	if (off < PACK_ALIGN || off % PACK_ALIGN != 0 ||
+	    !pack_valid(off + sizeof(record_t)))
+	{
+		return NULL;
+	}
+	r = (const record_t*) (pack.data + off);
+	if (r->magic != record_magic || r->pathlen == 0 ||
+	    r->pathlen > PACK_MAP || r->len > PACK_MAP ||
+	    !pack_valid(off + rec_size(r)) ||
+	    ((const char*) (r + 1))[r->pathlen - 1] != '\0')
+	{
+		return NULL;
+	}
+	return r;
+}
+
+/* the slot of path, or the empty one, where it belongs; path is not compared,
+ * if it is NULL
+ */
+static slot_t* index_slot(index_t *index, uint64_t hash, const char *path)
+{
+	slot_t *slots = pack_slots(index);
+	const record_t *r;
+	uint64_t i, n, mask = index->slots - 1;
+
+	for (i = hash & mask, n = 0; n < index->slots; i = (i + 1) & mask, n++) {
+		if (slots[i].off == 0)
+			return &slots[i];
+		if (path != NULL && slots[i].hash == hash &&
+		    (r = pack_record(slots[i].off)) != NULL &&
+		    STREQ((const char*) (r + 1), path))
+		{
+			return &slots[i];
+		}
+	}
+	return NULL;
+}
+
+static index_t* index_map(const char *path, size_t *size, ino_t *ino)
+{
+	int fd;
+	struct stat st;
+	index_t *index;
+
+	if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(index_t) ||
+	    (index = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                  fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	if (memcmp(index->magic, index_magic, sizeof(index_magic)) != 0 ||
+	    index->slots == 0 || (index->slots & (index->slots - 1)) != 0 ||
+	    (uint64_t) st.st_size != sizeof(index_t) + index->slots * sizeof(slot_t))
+	{
+		munmap(index, st.st_size);
+		return NULL;
+	}
+	*size = st.st_size;
+	*ino = st.st_ino;
+	return index;
+}
+
+static char* pack_tmppath(const char *path)
+{
+	size_t len = strlen(path) + 5;
+	char *tmp = (char*) emalloc(len);
+
+	snprintf(tmp, len, "%s.tmp", path);
+	return tmp;
+}
+
+/* an empty index with room for at least cnt paths, which becomes the index by
+ * index_commit()
+ */
+static index_t* index_create(uint64_t cnt, size_t *size)
+{
+	int fd;
+	char *tmp;
+	uint64_t slots = PACK_SLOTS;
+	index_t *index = NULL;
+
+	while (slots < 2 * cnt)
+		slots *= 2;
+	*size = sizeof(index_t) + slots * sizeof(slot_t);
+
+	tmp = pack_tmppath(pack.ipath);
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+		if (ftruncate(fd, *size) == 0) {
+			index = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (index == MAP_FAILED)
+				index = NULL;
+		}
+		close(fd);
+	}
+	if (index != NULL) {
+		memcpy(index->magic, index_magic, sizeof(index_magic));
+		index->slots = slots;
+	} else {
+		unlink(tmp);
+	}
+	free(tmp);
+	return index;
+}
+
+static bool index_commit(index_t *index, size_t size)
+{
+	char *tmp = pack_tmppath(pack.ipath);
+	struct stat st;
+	bool ok;
+
+	if ((ok = rename(tmp, pack.ipath) == 0 && stat(pack.ipath, &st) == 0)) {
+		if (pack.index != NULL)
+			munmap(pack.index, pack.isize);
+		pack.index = index;
+		pack.isize = size;
+		pack.iino = st.st_ino;
+	} else {
+		munmap(index, size);
+		unlink(tmp);
+	}
+	free(tmp);
+	return ok;
+}
+
+/* points the slot of path to the record at off */
+static void index_insert(index_t *index, uint64_t hash, const char *path,
+                         uint64_t off)
+{
+	slot_t *s = index_slot(index, hash, path);
+	const record_t *r;
+
+	if (s == NULL)
+		return;
+	if (s->off == 0)
+		index->used++;
+	else if ((r = pack_record(s->off)) != NULL)
+		index->dead += rec_size(r);
+	s->hash = hash;
+	s->off = off;
+}
+
+static bool index_resize(uint64_t cnt)
+{
+	slot_t *slots = pack_slots(pack.index);
+	index_t *index;
+	size_t size;
+	uint64_t i;
+
+	if ((index = index_create(cnt, &size)) == NULL)
+		return false;
+	for (i = 0; i < pack.index->slots; i++) {
+		if (slots[i].off != 0)
+			*index_slot(index, slots[i].hash, NULL) = slots[i];
+	}
+	index->used = pack.index->used;
+	index->dead = pack.index->dead;
+	return index_commit(index, size);
+}
+
+/* indexes all records in the data file, if the index is missing */
+static bool index_rebuild(void)
+{
+	const record_t *r;
+	index_t *index;
+	size_t size;
+	uint64_t off, cnt = 0;
+
+	for (off = PACK_ALIGN; (r = pack_record(off)) != NULL; off += rec_size(r))
+		cnt++;
+	if ((index = index_create(cnt, &size)) == NULL)
+		return false;
+	for (off = PACK_ALIGN; (r = pack_record(off)) != NULL; off += rec_size(r))
+		index_insert(index, pack_hash((const char*) (r + 1)), (const char*) (r + 1), off);
+	return index_commit(index, size);
+}
+
+/* (re)opens the files, the current ones are kept mapped */
+static bool pack_open(void)
+{
+	int fd;
+	char head[PACK_ALIGN];
+	const char *data;
+	struct stat st, cur;
+
+	for (;;) {
+		if ((fd = open(pack.dpath, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+			return false;
+		if (!pack_lock(fd, F_WRLCK) || fstat(fd, &st) < 0) {
+			close(fd);
+			return false;
+		}
+		/* it may have been replaced, before it was locked */
+		if (stat(pack.dpath, &cur) == 0 && cur.st_ino == st.st_ino &&
+		    cur.st_dev == st.st_dev)
+		{
+			break;
+		}
+		close(fd);
+	}
+	memset(head, 0, sizeof(head));
+	if (st.st_size == 0) {
+		memcpy(head, data_magic, sizeof(data_magic));
+		if (!pack_write(fd, head, sizeof(head), 0))
+			goto fail;
+		st.st_size = sizeof(head);
+	} else if (pread(fd, head, sizeof(head), 0) != sizeof(head) ||
+	           memcmp(head, data_magic, sizeof(data_magic)) != 0)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	if ((data = mmap(NULL, PACK_MAP, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto fail;
+
+	if (pack.data != NULL) {
+		pack.old = erealloc(pack.old, (pack.oldcnt + 1) * sizeof(*pack.old));
+		pack.old[pack.oldcnt++] = pack.data;
+	}
+	if (pack.fd >= 0)
+		close(pack.fd);
+	if (pack.index != NULL)
+		munmap(pack.index, pack.isize);
+	pack.index = NULL;
+	pack.fd = fd;
+	pack.dev = st.st_dev;
+	pack.dino = st.st_ino;
+	pack.data = data;
+	pack.dlen = st.st_size;
+
+	if ((pack.index = index_map(pack.ipath, &pack.isize, &pack.iino)) == NULL &&
+	    !index_rebuild())
+	{
+		close(pack.fd);
+		pack.fd = -1;
+		return false;
+	}
+	pack_lock(fd, F_UNLCK);
+	return true;
+
+fail:
+	close(fd);
+	return false;
+}
+
+/* locks the data file for writing, after the files were opened again, if
+ * another process replaced them
+ */
+static bool pack_acquire(void)
+{
+	struct stat d, i;
+
+	for (;;) {
+		if (pack.fd < 0 || !pack_lock(pack.fd, F_WRLCK))
+			return false;
+		if (stat(pack.dpath, &d) == 0 && stat(pack.ipath, &i) == 0 &&
+		    d.st_dev == pack.dev && d.st_ino == pack.dino && i.st_ino == pack.iino)
+		{
+			return true;
+		}
+		pack_lock(pack.fd, F_UNLCK);
+		if (!pack_open())
+			return false;
+	}
+}
+
+/* writes the records of the files, which still exist unchanged, if clean is
+ * true, or of all files otherwise, to new files; pack.lock and the lock of the
+ * data file are held
+ */
+static bool pack_rewrite(bool clean)
+{
+	int fd;
+	char *tmp;
+	char head[PACK_ALIGN];
+	slot_t *slots = pack_slots(pack.index);
+	const record_t *r;
+	struct stat st;
+	index_t *index;
+	size_t size;
+	uint64_t i, off = sizeof(head);
+	bool ok = false;
+
+	if ((index = index_create(pack.index->used, &size)) == NULL)
+		return false;
+	tmp = pack_tmppath(pack.dpath);
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		munmap(index, size);
+		goto end;
+	}
+	memset(head, 0, sizeof(head));
+	memcpy(head, data_magic, sizeof(data_magic));
+	if (!pack_write(fd, head, sizeof(head), 0))
+		goto fail;
+
+	for (i = 0; i < pack.index->slots; i++) {
+		if (slots[i].off == 0 || (r = pack_record(slots[i].off)) == NULL)
+			continue;
+		if (clean && (stat((const char*) (r + 1), &st) < 0 ||
+		    (uint64_t) st.st_size != r->size || st.st_mtime != r->mtime))
+		{
+			continue;
+		}
+		if (!pack_write(fd, r, rec_size(r), off))
+			goto fail;
+		*index_slot(index, slots[i].hash, NULL) = (slot_t) { slots[i].hash, off };
+		index->used++;
+		off += rec_size(r);
+	}
+	if (rename(tmp, pack.dpath) < 0)
+		goto fail;
+	/* without an index, it is rebuilt from the new data file */
+	if (!index_commit(index, size))
+		unlink(pack.ipath);
+	ok = true;
+	goto end;
+
+fail:
+	munmap(index, size);
+end:
+	if (fd >= 0)
+		close(fd);
+	if (!ok)
+		unlink(tmp);
+	free(tmp);
+	return ok;
+}
+
+/* opens the cache in directory dir, returns false, if it can not be used */
+bool cache_open(const char *dir)
+{
+	char *d;
+	size_t len;
+	bool ok;
+
+	if (pack.dpath != NULL)
+		return pack.fd >= 0;
+
+	d = estrdup(dir);
+	ok = r_mkdir(d) == 0;
+	free(d);
+	if (!ok) {
+		error(0, errno, "%s", dir);
+		return false;
+	}
+	len = strlen(dir) + 13;
+	pack.dpath = (char*) emalloc(len);
+	snprintf(pack.dpath, len, "%s/thumbs.pack", dir);
+	pack.ipath = (char*) emalloc(len);
+	snprintf(pack.ipath, len, "%s/thumbs.idx", dir);
+
+	pthread_rwlock_wrlock(&pack.lock);
+	if (!(ok = pack_open()))
+		error(0, errno, "%s", pack.dpath);
+	pthread_rwlock_unlock(&pack.lock);
+
+	if (ok && pack.index->dead >= PACK_COMPACT && pack.index->dead * 2 > pack.dlen)
+		cache_compact(false);
+	return ok;
+}
+
+/* the data cached for the file at path, which stays valid until exit; outdated
+ * is set, if there only is data for another version of the file
+ */
+const void* cache_find(const char *path, off_t size, time_t mtime, size_t *len,
+                       bool *outdated)
+{
+	const void *data = NULL;
+	const record_t *r;
+	slot_t *s;
+
+	pthread_rwlock_rdlock(&pack.lock);
+	if (pack.fd >= 0 && (s = index_slot(pack.index, pack_hash(path), path)) != NULL &&
+	    s->off != 0 && (r = pack_record(s->off)) != NULL)
+	{
+		if (r->size == (uint64_t) size && r->mtime == mtime) {
+			data = (const char*) r + ALIGNED(sizeof(record_t) + r->pathlen);
+			*len = r->len;
+		} else {
+			*outdated = true;
+		}
+	}
+	pthread_rwlock_unlock(&pack.lock);
+	return data;
+}
+
+/* appends the data for the file at path, which replaces the previous one */
+void cache_add(const char *path, off_t size, time_t mtime, const void *data,
+               size_t len)
+{
+	static const char zero[PACK_ALIGN];
+	record_t *r;
+	struct stat st;
+	uint64_t hlen, off;
+	char *head;
+
+	hlen = ALIGNED(sizeof(record_t) + strlen(path) + 1);
+	head = (char*) emalloc(hlen);
+	memset(head, 0, hlen);
+	r = (record_t*) head;
+	r->size = size;
+	r->mtime = mtime;
+	r->len = len;
+	r->pathlen = strlen(path) + 1;
+	r->magic = record_magic;
+	memcpy(head + sizeof(record_t), path, r->pathlen);
+
+	pthread_rwlock_wrlock(&pack.lock);
+	if (!pack_acquire())
+		goto end;
+	if (fstat(pack.fd, &st) < 0)
+		goto unlock;
+
+	/* the file is only full, until it is compacted */
+	off = ALIGNED(st.st_size);
+	if (off + hlen + ALIGNED(len) > PACK_MAP)
+		goto unlock;
+
+	if (!pack_write(pack.fd, head, hlen, off) ||
+	    !pack_write(pack.fd, data, len, off + hlen) ||
+	    !pack_write(pack.fd, zero, ALIGNED(len) - len, off + hlen + len))
+	{
+		goto unlock;
+	}
+	pack.dlen = off + rec_size(r);
+
+	if ((pack.index->used + 1) * 2 > pack.index->slots &&
+	    !index_resize(pack.index->used + 1))
+	{
+		goto unlock;
+	}
+	index_insert(pack.index, pack_hash(path), path, off);
+
+unlock:
+	pack_lock(pack.fd, F_UNLCK);
+end:
+	pthread_rwlock_unlock(&pack.lock);
+	free(head);
+}
+
+/* drops the replaced records and, if clean is true, the ones of files, which
+ * were changed or removed
+ */
+void cache_compact(bool clean)
+{
+	pthread_rwlock_wrlock(&pack.lock);
+	if (pack_acquire()) {
+		/* the replaced data file is unlocked by closing it */
+		if (!pack_rewrite(clean)) {
+			error(0, errno, "%s", pack.dpath);
+			pack_lock(pack.fd, F_UNLCK);
+		} else if (!pack_open()) {
+			error(0, errno, "%s", pack.dpath);
+		}
+	}
+	pthread_rwlock_unlock(&pack.lock);
+}
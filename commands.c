@@ -33,7 +33,9 @@ void open_info(void);
 int ptr_third_x(void);
 void redraw(void);
 void reset_cursor(void);
-void animate(void);
+void interact(void);
+void anim_start(void);
+void anim_stop(void);
 void slideshow(void);
 void set_timeout(timeout_f, int, bool);
 void reset_timeout(timeout_f);
@@ -171,10 +173,17 @@ bool cg_n_or_last(arg_t _)
 	}
 }
 
+static bool interactive(bool dirty)
+{
+	if (dirty)
+		interact();
+	return dirty;
+}
+
 bool cg_scroll_screen(arg_t dir)
 {
 	if (mode == MODE_IMAGE)
-		return img_pan(&img, dir, -1);
+		return interactive(img_pan(&img, dir, -1));
 	else
 		return tns_scroll(&tns, dir, true);
 }
@@ -184,9 +193,9 @@ bool cg_zoom(arg_t d)
 	if (mode == MODE_THUMB)
 		return tns_zoom(&tns, d);
 	else if (d > 0)
-		return img_zoom_in(&img);
+		return interactive(img_zoom_in(&img));
 	else if (d < 0)
-		return img_zoom_out(&img);
+		return interactive(img_zoom_out(&img));
 	else
 		return false;
 }
@@ -313,10 +322,10 @@ bool ci_toggle_animation(arg_t _)
 	if (img.multi.cnt > 0) {
 		img.multi.animate = !img.multi.animate;
 		if (img.multi.animate) {
-			dirty = img_frame_animate(&img);
-			set_timeout(animate, img.multi.frames[img.multi.sel].delay, true);
+			dirty = img_frame_animate(&img, 1);
+			anim_start();
 		} else {
-			reset_timeout(animate);
+			anim_stop();
 		}
 	}
 	return dirty;
@@ -324,7 +333,7 @@ bool ci_toggle_animation(arg_t _)
 
 bool ci_scroll(arg_t dir)
 {
-	return img_pan(&img, dir, prefix);
+	return interactive(img_pan(&img, dir, prefix));
 }
 
 bool ci_scroll_to_edge(arg_t dir)
@@ -357,6 +366,7 @@ bool ci_drag(arg_t mode)
 	}
 
 	if (img_pos(&img, px, py)) {
+		interact();
 		img_render(&img);
 		win_draw(&win);
 	}
@@ -10,6 +10,12 @@ enum {
  * -B 'background' -C 'foreground' and -F 'font'
  */
 
+#endif
+#ifdef _RENDER_CONFIG
+
+/* number of threads used for scaling images, 0 for one per cpu core: */
+enum { RENDER_THREADS = 0 };
+
 #endif
 #ifdef _IMAGE_CONFIG
 
@@ -21,6 +27,48 @@ static const float zoom_levels[] = {
 	100.0, 150.0, 200.0, 400.0, 800.0
 };
 
+/* size (in MiB) of the cache for decoded images, which are not displayed;
+ * the least recently used images are dropped first:
+ */
+enum { IMG_CACHE_SIZE = 256 };
+
+/* images of at least TILE_IMAGE_SIZE megapixels are shown through a pyramid of
+ * downscaled copies, which are split into tiles of TILE_SIZE x TILE_SIZE pixels
+ * and created when they become visible; large jpeg files are only decoded at
+ * 1/8 of their resolution up front. TILE_CACHE_SIZE (in MiB) limits the memory
+ * used by tiles, which are not visible anymore:
+ */
+enum {
+	TILE_IMAGE_SIZE = 32,
+	TILE_SIZE       = 256,
+	TILE_CACHE_SIZE = 128
+};
+
+/* the scaled image is kept for the window area and VIEW_MARGIN percent of the
+ * window size around it, so that panning and redrawing at the same zoom level
+ * only copy pixels:
+ */
+enum { VIEW_MARGIN = 25 };
+
+/* number of images after/before the current one, which are decoded in advance
+ * while the current image is shown:
+ */
+enum {
+	PREFETCH_NEXT = 2,
+	PREFETCH_PREV = 1
+};
+
+/* animated gifs are decoded while they are shown: only the current frame and
+ * GIF_AHEAD frames after it are kept as full images. The other frames are
+ * stored as the palette indices of the area they change, as long as they fit
+ * into GIF_CACHE_SIZE (in MiB), up to a quarter of which is used for snapshots
+ * of every n-th frame, from which the drawing restarts when seeking:
+ */
+enum {
+	GIF_AHEAD      = 8,
+	GIF_CACHE_SIZE = 128
+};
+
 /* default slideshow delay (in sec, overwritten via -S option): */
 enum { SLIDESHOW_DELAY = 5 };
 
@@ -38,6 +86,16 @@ static const int PAN_FRACTION = 5;
  */
 static const bool ANTI_ALIAS = true;
 
+/* filter used for anti-aliasing: FILTER_BOX, FILTER_BILINEAR or the sharper,
+ * but slower FILTER_LANCZOS
+ */
+static const filter_t ANTI_ALIAS_FILTER = FILTER_LANCZOS;
+
+/* filter used instead, while zooming, panning or holding keys, until no input
+ * arrived for a moment, when the image is rendered again with the one above:
+ */
+static const filter_t INTERACTIVE_FILTER = FILTER_BILINEAR;
+
 /* if true, use a checkerboard background for alpha layer,
  * toggled with 'A' key binding
  */
@@ -52,6 +110,24 @@ static const int thumb_sizes[] = { 32, 64, 96, 128, 160 };
 /* thumbnail size at startup, index into thumb_sizes[]: */
 static const int THUMB_SIZE = 3;
 
+/* filter used for scaling down the images to thumbnails: */
+static const filter_t THUMB_FILTER = FILTER_BOX;
+
+/* number of threads used for loading thumbnails, 0 for one per cpu core, and
+ * number of rows after the visible ones in scroll direction, which are loaded
+ * before the remaining thumbnails are cached:
+ */
+enum {
+	THUMB_THREADS = 0,
+	THUMB_AHEAD   = 2
+};
+
+/* if true, thumbnails are cached in a single packed file with an index under
+ * $XDG_CACHE_HOME/swiv/, otherwise as one file per thumbnail in a copy of the
+ * directory tree under $XDG_CACHE_HOME/swiv/thumbs-<version>/:
+ */
+static const bool THUMB_CACHE_PACKED = true;
+
 #endif
 #ifdef _MAPPINGS_CONFIG
 
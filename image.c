@@ -20,13 +20,28 @@
 #define _IMAGE_CONFIG
 #include "config.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#define RAW_SSSE3 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define RAW_NEON 1
+#include <arm_neon.h>
+#endif
+
 #if HAVE_LIBEXIF
 #include <libexif/exif-data.h>
 #endif
@@ -34,8 +49,28 @@
 #if HAVE_GIFLIB
 #include <gif_lib.h>
 enum { DEF_GIF_DELAY = 75 };
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#endif
+
+#if HAVE_LIBJPEG
+#include <jpeglib.h>
+#include <setjmp.h>
+#endif
+
+#if HAVE_LIBJPEG && defined(LIBJPEG_TURBO_VERSION_NUMBER) && \
+    LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#define JPEG_CROP 1
+#else
+#define JPEG_CROP 0
 #endif
 
+#define LEVEL_DIM(d, l) (((d) + (1 << (l)) - 1) >> (l))
+
+int tns_read(const fileinfo_t*, int, int);
+bool tns_read_done(fileinfo_t*, DATA32**, int*, int*, bool*);
+
 float zoom_min;
 float zoom_max;
 
@@ -46,6 +81,8 @@ static int zoomdiff(img_t *img, float z)
 
 void img_init(img_t *img, win_t *win)
 {
+	int i;
+
 	zoom_min = zoom_levels[0] / 100.0;
 	zoom_max = zoom_levels[ARRLEN(zoom_levels) - 1] / 100.0;
 
@@ -58,76 +95,522 @@ void img_init(img_t *img, win_t *win)
 	img->checkpan = false;
 	img->dirty = false;
 	img->aa = ANTI_ALIAS;
+	img->quick = false;
 	img->alpha = ALPHA_LAYER;
+	img->multi.frames = NULL;
 	img->multi.cap = img->multi.cnt = 0;
 	img->multi.animate = options->animate;
 	img->multi.framedelay = options->framerate > 0 ? 1000 / options->framerate : 0;
 	img->multi.length = 0;
+	img->multi.gif = NULL;
 
-	img->cmod = imlib_create_color_modifier();
-	imlib_context_set_color_modifier(img->cmod);
 	img->gamma = MIN(MAX(options->gamma, -GAMMA_RANGE), GAMMA_RANGE);
+	img->lut.tab = emalloc((2 * GAMMA_RANGE + 1) * 256);
+	img->lut.done = emalloc((2 * GAMMA_RANGE + 1) * sizeof(bool));
+	for (i = 0; i < 2 * GAMMA_RANGE + 1; i++)
+		img->lut.done[i] = false;
 
 	img->ss.on = options->slideshow > 0;
 	img->ss.delay = options->slideshow > 0 ? options->slideshow : SLIDESHOW_DELAY * 10;
+
+	img->path = NULL;
+	img->orient.rot = 0;
+	img->orient.flip = false;
+
+	img->cache.slots = NULL;
+	img->cache.cap = img->cache.cnt = 0;
+	img->cache.size = 0;
+	img->cache.tick = 0;
+	img->pf.sel = img->pf.cnt = -1;
+	img->pf.done = img->pf.pending = 0;
+	img->pf.fd = -1;
+
+	img->pyr.levels = NULL;
+	img->pyr.cnt = 0;
+	img->pyr.size = 0;
+	img->pyr.tick = 0;
+
+	img->area.w = 0;
+	img->shift.x = img->shift.y = 0;
+
+	img->view.data = NULL;
+	img->view.cap = 0;
+	img->view.im = NULL;
 }
 
 #if HAVE_LIBEXIF
-void exif_auto_orientate(const fileinfo_t *file)
+/* reads the orientation and the location of the embedded thumbnail from the
+ * exif data of a jpeg app1 segment, the tiff header starts at offset tiff of
+ * the file
+ */
+static void probe_exif(filemeta_t *m, const unsigned char *data, size_t len, off_t tiff)
 {
 	ExifData *ed;
 	ExifEntry *entry;
-	int byte_order, orientation = 0;
+	ExifByteOrder bo;
+	const unsigned char *t = data + 6, *e;
+	size_t tlen = len - 6, ifd, n, i, off = 0, plen = 0;
 
-	if ((ed = exif_data_new_from_file(file->path)) == NULL)
+	if ((ed = exif_data_new_from_data(data, len)) == NULL)
 		return;
-	byte_order = exif_data_get_byte_order(ed);
+	bo = exif_data_get_byte_order(ed);
 	entry = exif_content_get_entry(ed->ifd[EXIF_IFD_0], EXIF_TAG_ORIENTATION);
 	if (entry != NULL)
-		orientation = exif_get_short(entry->data, byte_order);
+		m->orientation = exif_get_short(entry->data, bo);
 	exif_data_unref(ed);
 
-	switch (orientation) {
-		case 5:
-			imlib_image_orientate(1);
-		case 2:
-			imlib_image_flip_vertical();
-			break;
-		case 3:
-			imlib_image_orientate(2);
-			break;
-		case 7:
-			imlib_image_orientate(1);
-		case 4:
-			imlib_image_flip_horizontal();
-			break;
-		case 6:
-			imlib_image_orientate(1);
+	/* libexif does not keep the offset of the thumbnail, which is given by
+	 * the JPEGInterchangeFormat tags of the second ifd
+	 */
+	if (tlen < 8 || (ifd = exif_get_long(t + 4, bo)) > tlen - 2)
+		return;
+	if ((ifd += 2 + 12 * exif_get_short(t + ifd, bo)) > tlen - 4)
+		return;
+	if ((ifd = exif_get_long(t + ifd, bo)) == 0 || ifd > tlen - 2)
+		return;
+	n = exif_get_short(t + ifd, bo);
+	for (i = 0; i < n && ifd + 2 + 12 * (i + 1) <= tlen; i++) {
+		e = t + ifd + 2 + 12 * i;
+		if (exif_get_short(e, bo) == EXIF_TAG_JPEG_INTERCHANGE_FORMAT)
+			off = exif_get_long(e + 8, bo);
+		else if (exif_get_short(e, bo) == EXIF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH)
+			plen = exif_get_long(e + 8, bo);
+	}
+	if (off > 0 && plen > 0 && off <= tlen && plen <= tlen - off) {
+		m->preview = tiff + off;
+		m->preview_len = plen;
+	}
+}
+#endif
+
+/* walks the markers of a jpeg file up to the frame header */
+static void probe_jpeg(int fd, filemeta_t *m)
+{
+	unsigned char hdr[9];
+	off_t off = 2;
+	int marker, len;
+
+	while (pread(fd, hdr, 4, off) == 4 && hdr[0] == 0xff) {
+		if ((marker = hdr[1]) == 0xff) {
+			off++;
+			continue;
+		}
+		len = hdr[2] << 8 | hdr[3];
+		if (marker >= 0xc0 && marker <= 0xcf &&
+		    marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+		{
+			if (pread(fd, hdr, 9, off) == 9) {
+				m->h = hdr[5] << 8 | hdr[6];
+				m->w = hdr[7] << 8 | hdr[8];
+			}
 			break;
-		case 8:
-			imlib_image_orientate(3);
+		} else if (marker == 0xd9 || marker == 0xda || len < 2) {
 			break;
+		}
+#if HAVE_LIBEXIF
+		if (marker == 0xe1 && len > 14 && m->orientation == 0 && m->preview == 0) {
+			unsigned char *seg = (unsigned char*) emalloc(len - 2);
+
+			if (pread(fd, seg, len - 2, off + 4) == len - 2 &&
+			    memcmp(seg, "Exif\0\0", 6) == 0)
+			{
+				probe_exif(m, seg, len - 2, off + 4 + 6);
+			}
+			free(seg);
+		}
+#endif
+		off += 2 + len;
 	}
 }
-#endif
+
+/* reads the format, size, exif orientation and the location of the exif
+ * thumbnail of the file from its header, only if it was changed since the
+ * last call; returns false, if the file is not a readable regular file
+ */
+bool img_probe(fileinfo_t *file)
+{
+	filemeta_t *m = &file->meta;
+	unsigned char buf[24];
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	if (stat(file->path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		m->valid = false;
+		return false;
+	}
+	if (m->valid && m->mtime == st.st_mtime && m->size == st.st_size)
+		return true;
+
+	if ((fd = open(file->path, O_RDONLY)) < 0) {
+		m->valid = false;
+		return false;
+	}
+	memset(m, 0, sizeof(*m));
+	m->valid = true;
+	m->mtime = st.st_mtime;
+	m->size = st.st_size;
+
+	n = pread(fd, buf, sizeof(buf), 0);
+	if (n >= 3 && buf[0] == 0xff && buf[1] == 0xd8 && buf[2] == 0xff) {
+		m->format = FMT_JPEG;
+		probe_jpeg(fd, m);
+	} else if (n >= 24 && memcmp(buf, "\x89PNG\r\n\x1a\n", 8) == 0) {
+		m->format = FMT_PNG;
+		m->w = buf[16] << 24 | buf[17] << 16 | buf[18] << 8 | buf[19];
+		m->h = buf[20] << 24 | buf[21] << 16 | buf[22] << 8 | buf[23];
+	} else if (n >= 10 && memcmp(buf, "GIF8", 4) == 0) {
+		m->format = FMT_GIF;
+		m->w = buf[7] << 8 | buf[6];
+		m->h = buf[9] << 8 | buf[8];
+	} else if (n >= 16 && memcmp(buf, "farbfeld", 8) == 0) {
+		m->format = FMT_FARBFELD;
+		m->w = buf[8] << 24 | buf[9] << 16 | buf[10] << 8 | buf[11];
+		m->h = buf[12] << 24 | buf[13] << 16 | buf[14] << 8 | buf[15];
+	} else if (n >= 3 && buf[0] == 'P' && (buf[1] == '6' || buf[1] == '7') &&
+	           isspace(buf[2]))
+	{
+		m->format = FMT_PNM;
+	}
+	close(fd);
+
+	return true;
+}
+
+static void img_free_data(void *im, void *data)
+{
+	free(data);
+}
+
+/* wraps pixels, which were allocated with malloc(), into an image, which frees
+ * them, when it is freed, and makes it the context image; frees them and
+ * returns NULL on failure
+ */
+Imlib_Image img_from_data(DATA32 *data, int w, int h, bool alpha)
+{
+	Imlib_Image im;
+
+	if ((im = imlib_create_image_using_data(w, h, data)) == NULL) {
+		free(data);
+		return NULL;
+	}
+	imlib_context_set_image(im);
+	imlib_image_attach_data_value("swiv-data", data, 0, img_free_data);
+	imlib_image_set_has_alpha(alpha);
+	return im;
+}
+
+/* the exif orientation of the file as a horizontal flip followed by a
+ * clockwise rotation by rot * 90 degrees
+ */
+void exif_orientation(const fileinfo_t *file, bool *flip, int *rot)
+{
+	static const bool exif_flip[9] = { 0, 0, 1, 0, 1, 1, 0, 1, 0 };
+	static const int exif_rot[9] = { 0, 0, 2, 2, 0, 1, 1, 3, 3 };
+	int i = file->meta.orientation;
+
+	if (i < 0 || i >= ARRLEN(exif_rot))
+		i = 0;
+	*flip = exif_flip[i];
+	*rot = exif_rot[i];
+}
 
 #if HAVE_GIFLIB
-bool img_load_gif(img_t *img, const fileinfo_t *file)
+static int gif_read(GifFileType *gif, GifByteType *buf, int n)
+{
+	img_gif_t *g = (img_gif_t*) gif->UserData;
+
+	n = MIN((size_t) n, g->len - g->pos);
+	memcpy(buf, g->data + g->pos, n);
+	g->pos += n;
+	return n;
+}
+
+static void gif_close(img_gif_t *g)
+{
+	if (g->dec != NULL) {
+#if defined(GIFLIB_MAJOR) && GIFLIB_MAJOR >= 5 && GIFLIB_MINOR >= 1
+		DGifCloseFile(g->dec, NULL);
+#else
+		DGifCloseFile(g->dec);
+#endif
+		g->dec = NULL;
+	}
+}
+
+/* (re)opens the decoder, which has to be positioned at a record afterwards */
+static bool gif_open(img_gif_t *g)
+{
+	gif_close(g);
+	g->pos = 0;
+#if defined(GIFLIB_MAJOR) && GIFLIB_MAJOR >= 5
+	g->dec = DGifOpen(g, gif_read, NULL);
+#else
+	g->dec = DGifOpen(g, gif_read);
+#endif
+	return g->dec != NULL;
+}
+
+static void gif_free(img_gif_t *g)
+{
+	gif_close(g);
+	free(g->data);
+	free(g->canvas);
+	free(g->pix);
+	free(g);
+}
+
+/* expands n palette indices through the lut, transparent pixels are taken
+ * from src
+ */
+static void gif_expand_row(DATA32 *dst, const DATA32 *src, const GifPixelType *idx,
+                           const DATA32 *lut, int n, int transp)
+{
+	int i = 0;
+
+#ifdef __AVX2__
+	const __m256i t = _mm256_set1_epi32(transp);
+	__m256i v, p, m;
+
+	for (; i + 8 <= n; i += 8) {
+		v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (idx + i)));
+		p = _mm256_i32gather_epi32((const int*) lut, v, 4);
+		m = _mm256_cmpeq_epi32(v, t);
+		p = _mm256_blendv_epi8(p, _mm256_loadu_si256((const __m256i*) (src + i)), m);
+		_mm256_storeu_si256((__m256i*) (dst + i), p);
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = idx[i] == transp ? src[i] : lut[idx[i]];
+}
+
+/* returns the palette indices of the area of frame f, which changes the
+ * canvas, and their palette; they are read from the file, if they are not
+ * stored with the frame, and stored with it, as long as the budget allows
+ */
+static const unsigned char* img_gif_pixels(img_gif_t *g, img_frame_t *f,
+                                           const DATA32 **lut, int *stride)
 {
 	GifFileType *gif;
-	GifRowType *rows = NULL;
 	GifRecordType rec;
 	ColorMapObject *cmap;
-	DATA32 bgpixel, *data, *ptr;
-	DATA32 *prev_frame = NULL;
-	Imlib_Image im;
-	int i, j, bg, r, g, b;
-	int x, y, w, h, sw, sh;
-	int px, py, pw, ph;
+	GifColorType *c;
+	size_t size;
+	int i, j, w, h;
 	int intoffset[] = { 0, 4, 2, 1 };
 	int intjump[] = { 8, 8, 4, 2 };
+
+	if (f->pix != NULL) {
+		*lut = f->lut;
+		*stride = f->w;
+		return f->pix;
+	}
+	if (g->dec == NULL && !gif_open(g))
+		return NULL;
+	gif = g->dec;
+
+	/* skip the extensions, their values are known */
+	g->pos = f->pos;
+	if (DGifGetRecordType(gif, &rec) == GIF_ERROR || rec != IMAGE_DESC_RECORD_TYPE ||
+	    DGifGetImageDesc(gif) == GIF_ERROR)
+	{
+		return NULL;
+	}
+	if ((cmap = gif->Image.ColorMap ? gif->Image.ColorMap : gif->SColorMap) == NULL)
+		return NULL;
+	w = gif->Image.Width;
+	h = gif->Image.Height;
+
+	if ((size_t) w * h > g->pixcap) {
+		g->pixcap = (size_t) w * h;
+		g->pix = erealloc(g->pix, g->pixcap);
+	}
+	if (gif->Image.Interlace) {
+		for (i = 0; i < 4; i++) {
+			for (j = intoffset[i]; j < h; j += intjump[i])
+				DGifGetLine(gif, g->pix + j * w, w);
+		}
+	} else {
+		for (i = 0; i < h; i++)
+			DGifGetLine(gif, g->pix + i * w, w);
+	}
+
+	for (i = 0; i < ARRLEN(g->lut); i++) {
+		c = &cmap->Colors[MIN(i, cmap->ColorCount - 1)];
+		g->lut[i] = 0xffu << 24 | c->Red << 16 | c->Green << 8 | c->Blue;
+	}
+
+	/* the part of the frame on the canvas */
+	f->x = MIN(gif->Image.Left, g->w);
+	f->y = MIN(gif->Image.Top, g->h);
+	f->w = MIN(gif->Image.Left + w, g->w) - f->x;
+	f->h = MIN(gif->Image.Top + h, g->h) - f->y;
+
+	size = (size_t) f->w * f->h + sizeof(g->lut);
+	if (g->size + size <= (size_t) GIF_CACHE_SIZE << 20) {
+		f->pix = (unsigned char*) emalloc(MAX((size_t) f->w * f->h, 1));
+		for (i = 0; i < f->h; i++)
+			memcpy(f->pix + i * f->w, g->pix + i * w, f->w);
+		f->lut = (DATA32*) emalloc(sizeof(g->lut));
+		memcpy(f->lut, g->lut, sizeof(g->lut));
+		g->size += size;
+		*lut = f->lut;
+		*stride = f->w;
+		return f->pix;
+	}
+	*lut = g->lut;
+	*stride = w;
+	return g->pix;
+}
+
+/* draws frame g->next onto the canvas, the resulting image is only created,
+ * if want is true
+ */
+static bool img_gif_draw(img_t *img, bool want)
+{
+	img_gif_t *g = img->multi.gif;
+	img_frame_t *f = &img->multi.frames[g->next];
+	Imlib_Image im;
+	const unsigned char *pix;
+	const DATA32 *lut;
+	DATA32 *data = NULL, *dst;
+	size_t size = (size_t) g->w * g->h * sizeof(DATA32);
+	int i, j, x, y, x1, y1, stride, sw = g->w, sh = g->h;
+
+	if (g->next > 0 && g->next % g->keyint == 0 && f->key == NULL) {
+		f->key = (DATA32*) emalloc(size);
+		memcpy(f->key, g->canvas, size);
+		g->size += size;
+	}
+	if (!want && f->disposal == 3) {
+		g->next++;
+		return true;
+	}
+	if ((pix = img_gif_pixels(g, f, &lut, &stride)) == NULL)
+		return false;
+
+	if (want) {
+		if ((im = imlib_create_image(sw, sh)) == NULL)
+			error(EXIT_FAILURE, ENOMEM, NULL);
+		imlib_context_set_image(im);
+		data = imlib_image_get_data();
+	}
+	/* frames, which restore the previous canvas, are drawn next to it,
+	 * everything outside of the frame is copied from the canvas then
+	 */
+	dst = f->disposal == 3 ? data : g->canvas;
+	x = f->x;
+	y = f->y;
+	x1 = x + f->w;
+	y1 = y + f->h;
+
+	if (dst != g->canvas) {
+		memcpy(dst, g->canvas, y * sw * sizeof(DATA32));
+		memcpy(dst + y1 * sw, g->canvas + y1 * sw, (sh - y1) * sw * sizeof(DATA32));
+	}
+	for (i = y; i < y1; i++) {
+		if (dst != g->canvas) {
+			memcpy(dst + i * sw, g->canvas + i * sw, x * sizeof(DATA32));
+			memcpy(dst + i * sw + x1, g->canvas + i * sw + x1, (sw - x1) * sizeof(DATA32));
+		}
+		gif_expand_row(dst + i * sw + x, g->canvas + i * sw + x,
+		               pix + (i - y) * stride, lut, x1 - x, f->transp);
+	}
+
+	if (want) {
+		if (dst == g->canvas)
+			memcpy(data, g->canvas, size);
+		imlib_image_put_back_data(data);
+		imlib_image_set_format("gif");
+		if (f->transp >= 0)
+			imlib_image_set_has_alpha(1);
+		f->im = im;
+		g->size += size;
+	}
+	if (f->disposal == 2) {
+		for (i = y; i < y1; i++) {
+			for (j = x; j < x1; j++)
+				g->canvas[i * sw + j] = g->bg;
+		}
+	}
+	g->next++;
+	return true;
+}
+
+/* drops the images of all frames except frame n, the current one and the ones
+ * ahead of it
+ */
+static void img_gif_evict(img_t *img, int n)
+{
+	multi_img_t *multi = &img->multi;
+	img_gif_t *g = multi->gif;
+	size_t size = (size_t) g->w * g->h * sizeof(DATA32);
+	int d, i;
+
+	for (d = multi->cnt - 1; d > GIF_AHEAD; d--) {
+		i = (multi->sel + d) % multi->cnt;
+		if (i != n && multi->frames[i].im != NULL) {
+			imlib_context_set_image(multi->frames[i].im);
+			imlib_free_image();
+			multi->frames[i].im = NULL;
+			g->size -= size;
+		}
+	}
+}
+
+/* returns frame n, which is decoded starting at the canvas or the closest
+ * snapshot before it, if it is not cached
+ */
+static Imlib_Image img_gif_frame(img_t *img, int n)
+{
+	multi_img_t *multi = &img->multi;
+	img_gif_t *g = multi->gif;
+	int i, k;
+
+	if (multi->frames[n].im != NULL)
+		return multi->frames[n].im;
+
+	for (k = n - n % g->keyint; k > 0 && multi->frames[k].key == NULL; k -= g->keyint);
+
+	if (g->next < k || g->next > n) {
+		/* the decoder is reopened, when it is needed */
+		gif_close(g);
+		if (k > 0) {
+			memcpy(g->canvas, multi->frames[k].key, (size_t) g->w * g->h * sizeof(DATA32));
+		} else {
+			for (i = 0; i < g->w * g->h; i++)
+				g->canvas[i] = g->bg;
+		}
+		g->next = k;
+	}
+	while (g->next <= n) {
+		if (!img_gif_draw(img, g->next == n)) {
+			gif_close(g);
+			return NULL;
+		}
+	}
+	img_gif_evict(img, n);
+
+	return multi->frames[n].im;
+}
+
+/* reads the file into memory and indexes its frames, which are decoded when
+ * they are needed
+ */
+bool img_load_gif(img_t *img, const fileinfo_t *file)
+{
+	img_gif_t *g;
+	GifFileType *gif;
+	GifRecordType rec;
+	GifByteType *ext, *code;
+	Imlib_Image im;
+	img_frame_t *f;
+	struct stat st;
+	ssize_t n;
+	size_t pos, fsize;
+	int fd, nkey, ext_code, code_size;
 	int transp = -1;
-	unsigned int disposal = 0, prev_disposal = 0;
+	unsigned int disposal = 0;
 	unsigned int delay = 0;
 	bool err = false;
 
@@ -139,29 +622,41 @@ bool img_load_gif(img_t *img, const fileinfo_t *file)
 	img->multi.cnt = img->multi.sel = 0;
 	img->multi.length = 0;
 
-#if defined(GIFLIB_MAJOR) && GIFLIB_MAJOR >= 5
-	gif = DGifOpenFileName(file->path, NULL);
-#else
-	gif = DGifOpenFileName(file->path);
-#endif
-	if (gif == NULL) {
+	g = (img_gif_t*) emalloc(sizeof(img_gif_t));
+	memset(g, 0, sizeof(img_gif_t));
+
+	if ((fd = open(file->path, O_RDONLY)) >= 0 && fstat(fd, &st) == 0) {
+		g->data = emalloc(st.st_size + 1);
+		while (g->len < (size_t) st.st_size &&
+		       (n = read(fd, g->data + g->len, st.st_size - g->len)) > 0)
+		{
+			g->len += n;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	if (g->len == 0 || !gif_open(g)) {
 		error(0, 0, "%s: Error opening gif image", file->name);
+		gif_free(g);
 		return false;
 	}
-	bg = gif->SBackGroundColor;
-	sw = gif->SWidth;
-	sh = gif->SHeight;
-	px = py = pw = ph = 0;
+	gif = g->dec;
+	g->w = gif->SWidth;
+	g->h = gif->SHeight;
+	if (gif->SColorMap != NULL && gif->SBackGroundColor < gif->SColorMap->ColorCount) {
+		GifColorType *c = &gif->SColorMap->Colors[gif->SBackGroundColor];
+
+		g->bg = 0x00ffffff & (c->Red << 16 | c->Green << 8 | c->Blue);
+	}
 
 	do {
+		pos = g->pos;
 		if (DGifGetRecordType(gif, &rec) == GIF_ERROR) {
 			err = true;
 			break;
 		}
 		if (rec == EXTENSION_RECORD_TYPE) {
-			int ext_code;
-			GifByteType *ext = NULL;
-
+			ext = NULL;
 			DGifGetExtension(gif, &ext_code, &ext);
 			while (ext) {
 				if (ext_code == GRAPHICS_EXT_FUNC_CODE) {
@@ -177,161 +672,1355 @@ bool img_load_gif(img_t *img, const fileinfo_t *file)
 				DGifGetExtensionNext(gif, &ext);
 			}
 		} else if (rec == IMAGE_DESC_RECORD_TYPE) {
-			if (DGifGetImageDesc(gif) == GIF_ERROR) {
-				err = true;
+			/* skip the compressed pixel data */
+			err = DGifGetImageDesc(gif) == GIF_ERROR ||
+			      DGifGetCode(gif, &code_size, &code) == GIF_ERROR;
+			while (!err && code != NULL)
+				err = DGifGetCodeNext(gif, &code) == GIF_ERROR;
+			if (err)
 				break;
+
+			if (img->multi.cnt == img->multi.cap) {
+				img->multi.cap *= 2;
+				img->multi.frames = (img_frame_t*)
+				                    erealloc(img->multi.frames,
+				                             img->multi.cap * sizeof(img_frame_t));
 			}
-			x = gif->Image.Left;
-			y = gif->Image.Top;
-			w = gif->Image.Width;
-			h = gif->Image.Height;
-
-			rows = (GifRowType*) emalloc(h * sizeof(GifRowType));
-			for (i = 0; i < h; i++)
-				rows[i] = (GifRowType) emalloc(w * sizeof(GifPixelType));
-			if (gif->Image.Interlace) {
-				for (i = 0; i < 4; i++) {
-					for (j = intoffset[i]; j < h; j += intjump[i])
-						DGifGetLine(gif, rows[j], w);
-				}
+			f = &img->multi.frames[img->multi.cnt];
+			f->im = NULL;
+			f->key = NULL;
+			f->pix = NULL;
+			f->lut = NULL;
+			f->x = f->y = f->w = f->h = 0;
+			f->pos = pos;
+			f->transp = transp;
+			f->disposal = disposal;
+			delay = img->multi.framedelay > 0 ? img->multi.framedelay : delay;
+			f->delay = delay > 0 ? delay : DEF_GIF_DELAY;
+			img->multi.length += f->delay;
+			img->multi.cnt++;
+		}
+	} while (rec != TERMINATE_RECORD_TYPE);
+	gif_close(g);
+
+	if (err && (file->flags & FF_WARN))
+		error(0, 0, "%s: Corrupted gif file", file->name);
+
+	if (img->multi.cnt > 1) {
+		/* a quarter of the budget is used for snapshots */
+		fsize = (size_t) g->w * g->h * sizeof(DATA32);
+		nkey = ((size_t) GIF_CACHE_SIZE << 20) / 4 / MAX(fsize, 1);
+		g->keyint = MAX(8, nkey > 0 ? (img->multi.cnt + nkey - 1) / nkey : img->multi.cnt);
+		g->canvas = (DATA32*) emalloc(fsize);
+		img->multi.gif = g;
+
+		if ((im = img_gif_frame(img, 0)) != NULL) {
+			imlib_context_set_image(img->im);
+			imlib_free_image();
+			img->im = im;
+		} else {
+			img->multi.gif = NULL;
+			img->multi.cnt = 0;
+			gif_free(g);
+		}
+	} else {
+		img->multi.cnt = 0;
+		gif_free(g);
+	}
+
+	imlib_context_set_image(img->im);
+
+	return !err;
+}
+#endif /* HAVE_GIFLIB */
+
+#if HAVE_LIBJPEG
+/* true, if an image of size w x h covers a box of bw x bh in at least one of
+ * its dimensions, a zero box dimension is never covered
+ */
+static bool img_covers(int w, int h, int bw, int bh)
+{
+	return (bw > 0 && w >= bw) || (bh > 0 && h >= bh);
+}
+
+struct jpeg_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((struct jpeg_error*) cinfo->err)->env, 1);
+}
+
+static void jpeg_output_message(j_common_ptr cinfo)
+{
+}
+
+static void jpeg_out_color_space(j_decompress_ptr cinfo)
+{
+#if defined(JCS_EXTENSIONS) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (cinfo->jpeg_color_space != JCS_GRAYSCALE)
+		cinfo->out_color_space = JCS_EXT_BGRA;
+#else
+	if (cinfo->jpeg_color_space != JCS_GRAYSCALE)
+		cinfo->out_color_space = JCS_RGB;
+#endif
+}
+
+static void jpeg_convert_row(DATA32 *dst, JSAMPROW row, int n, int comps)
+{
+	int i;
+
+	if (comps == 4) {
+		memcpy(dst, row, n * sizeof(DATA32));
+	} else if (comps == 3) {
+		for (i = 0; i < n; i++, row += 3)
+			dst[i] = 0xffu << 24 | row[0] << 16 | row[1] << 8 | row[2];
+	} else if (comps == 1) {
+		for (i = 0; i < n; i++, row++)
+			dst[i] = 0xffu << 24 | row[0] << 16 | row[0] << 8 | row[0];
+	}
+}
+
+/* decodes the jpeg file with DCT scaling at the smallest power-of-two
+ * reduction, which still covers the box bw x bh in both orientations, into
+ * pixels of size ow x oh; w and h are set to the full size. Does not use
+ * imlib, so it can be called from any thread
+ */
+static DATA32* jpeg_decode(FILE *f, int bw, int bh, int *w, int *h, int *ow, int *oh)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error jerr;
+	DATA32 *volatile data = NULL;
+	unsigned char *volatile buf = NULL;
+	JSAMPROW row;
+	DATA32 *ptr;
+	int d;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	jerr.pub.output_message = jpeg_output_message;
+
+	if (setjmp(jerr.env)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(buf);
+		free(data);
+		return NULL;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	jpeg_read_header(&cinfo, TRUE);
+
+	if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+		/* leave adobe's inverted cmyk to imlib2 */
+		jpeg_destroy_decompress(&cinfo);
+		return NULL;
+	}
+	*w = cinfo.image_width;
+	*h = cinfo.image_height;
+
+	for (d = 8; d > 1; d /= 2) {
+#if JPEG_CROP
+		/* the finer levels of the pyramid are decoded on demand */
+		if ((double) *w * *h >= TILE_IMAGE_SIZE * 1e6)
+			break;
+#endif
+		*ow = (*w + d - 1) / d;
+		*oh = (*h + d - 1) / d;
+		if (img_covers(*ow, *oh, bw, bh) && img_covers(*oh, *ow, bw, bh))
+			break;
+	}
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = d;
+	jpeg_out_color_space(&cinfo);
+	jpeg_start_decompress(&cinfo);
+
+	*ow = cinfo.output_width;
+	*oh = cinfo.output_height;
+	data = emalloc((size_t) *ow * *oh * sizeof(DATA32));
+
+	if (cinfo.output_components != 4)
+		buf = emalloc(cinfo.output_width * cinfo.output_components);
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		ptr = data + cinfo.output_scanline * cinfo.output_width;
+		row = buf != NULL ? buf : (JSAMPROW) ptr;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+		if (buf != NULL)
+			jpeg_convert_row(ptr, row, cinfo.output_width, cinfo.output_components);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(buf);
+
+	return data;
+}
+
+static Imlib_Image img_open_jpeg(FILE *f, int bw, int bh, int *w, int *h)
+{
+	Imlib_Image im;
+	DATA32 *data;
+	int ow, oh;
+
+	if ((data = jpeg_decode(f, bw, bh, w, h, &ow, &oh)) == NULL)
+		return NULL;
+	if ((im = img_from_data(data, ow, oh, false)) != NULL)
+		imlib_image_set_format("jpeg");
+	return im;
+}
+
+#if JPEG_CROP
+/* decodes the region x, y, w, h of the jpeg file downscaled by d */
+static Imlib_Image img_jpeg_region(const char *path, int d, int x, int y, int w, int h)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error jerr;
+	FILE *f;
+	Imlib_Image volatile im = NULL;
+	unsigned char *volatile buf = NULL;
+	JSAMPROW row;
+	JDIMENSION cx = x, cw = w;
+	DATA32 *data;
+	int i;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return NULL;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	jerr.pub.output_message = jpeg_output_message;
+
+	if (setjmp(jerr.env)) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		free(buf);
+		if (im != NULL) {
+			imlib_context_set_image(im);
+			imlib_free_image();
+		}
+		return NULL;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = d;
+	jpeg_out_color_space(&cinfo);
+	jpeg_start_decompress(&cinfo);
+
+	/* the left edge is aligned to the next iMCU boundary */
+	jpeg_crop_scanline(&cinfo, &cx, &cw);
+	if (y > 0)
+		jpeg_skip_scanlines(&cinfo, y);
+
+	if ((im = imlib_create_image(w, h)) == NULL)
+		error(EXIT_FAILURE, ENOMEM, NULL);
+	imlib_context_set_image(im);
+	imlib_image_set_has_alpha(0);
+	data = imlib_image_get_data();
+	buf = emalloc(cinfo.output_width * cinfo.output_components);
+
+	for (i = 0; i < h; i++) {
+		row = buf;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+		jpeg_convert_row(data + i * w, buf + (x - cx) * cinfo.output_components,
+		                 w, cinfo.output_components);
+	}
+	imlib_image_put_back_data(data);
+
+	jpeg_destroy_decompress(&cinfo);
+	fclose(f);
+	free(buf);
+
+	return im;
+}
+#endif /* JPEG_CROP */
+#endif /* HAVE_LIBJPEG */
+
+/* farbfeld, binary ppm and pam files are read through a private mapping of the
+ * file: pam files with the tuple type BGRA, which is the layout of DATA32 on
+ * little-endian machines, are used as the pixels of the image as they are,
+ * the other layouts are converted in a single pass over the mapping
+ */
+typedef enum {
+	RAW_RGB,      /* 3 bytes per pixel */
+	RAW_RGBA,     /* 4 bytes per pixel */
+	RAW_RGBA16,   /* 8 bytes per pixel, channels are big-endian */
+	RAW_BGRA      /* DATA32 on little-endian machines */
+} rawlayout_t;
+
+typedef struct {
+	void *addr;
+	size_t len;
+} rawmap_t;
+
+static const int raw_bpp[] = { 3, 4, 8, 4 };
+
+/* skips white space and comments, returns the next token of at most len
+ * characters of the header or NULL
+ */
+static const char* pnm_token(const char **p, const char *end, char *buf, size_t len)
+{
+	size_t n = 0;
+
+	while (*p < end && (isspace((unsigned char) **p) || **p == '#')) {
+		if (**p == '#') {
+			while (*p < end && **p != '\n')
+				(*p)++;
+		} else {
+			(*p)++;
+		}
+	}
+	while (*p < end && !isspace((unsigned char) **p) && n < len - 1)
+		buf[n++] = *(*p)++;
+	buf[n] = '\0';
+	return n > 0 && (*p == end || isspace((unsigned char) **p)) ? buf : NULL;
+}
+
+static bool pnm_uint(const char **p, const char *end, int *v)
+{
+	char buf[16], *e;
+	long l;
+
+	if (pnm_token(p, end, buf, sizeof(buf)) == NULL)
+		return false;
+	l = strtol(buf, &e, 10);
+	if (*e != '\0' || l <= 0 || l > INT_MAX)
+		return false;
+	*v = l;
+	return true;
+}
+
+/* reads the header of a ppm or pam file with 8-bit samples; off is set to the
+ * offset of the pixels
+ */
+static bool pnm_header(const char *p, size_t len, size_t *off, int *w, int *h,
+                       rawlayout_t *layout)
+{
+	const char *end = p + len, *s = p + 2;
+	char buf[16];
+	int depth = 0, maxval = 0;
+	bool bgra = false, alpha = false;
+
+	if (len < 3 || p[0] != 'P')
+		return false;
+	if (p[1] == '6') {
+		if (!pnm_uint(&s, end, w) || !pnm_uint(&s, end, h) ||
+		    !pnm_uint(&s, end, &maxval) || s == end)
+		{
+			return false;
+		}
+		depth = 3;
+		s++;
+	} else if (p[1] == '7') {
+		*w = *h = 0;
+		while (pnm_token(&s, end, buf, sizeof(buf)) != NULL) {
+			if (strcmp(buf, "ENDHDR") == 0) {
+				while (s < end && *s != '\n')
+					s++;
+				if (s == end)
+					return false;
+				s++;
+				break;
+			} else if (strcmp(buf, "WIDTH") == 0) {
+				if (!pnm_uint(&s, end, w))
+					return false;
+			} else if (strcmp(buf, "HEIGHT") == 0) {
+				if (!pnm_uint(&s, end, h))
+					return false;
+			} else if (strcmp(buf, "DEPTH") == 0) {
+				if (!pnm_uint(&s, end, &depth))
+					return false;
+			} else if (strcmp(buf, "MAXVAL") == 0) {
+				if (!pnm_uint(&s, end, &maxval))
+					return false;
+			} else if (strcmp(buf, "TUPLTYPE") == 0) {
+				if (pnm_token(&s, end, buf, sizeof(buf)) == NULL)
+					return false;
+				bgra = strcmp(buf, "BGRA") == 0;
+				alpha = bgra || strcmp(buf, "RGB_ALPHA") == 0;
+			} else {
+				return false;
+			}
+		}
+		if (*w == 0 || *h == 0)
+			return false;
+	} else {
+		return false;
+	}
+	if (maxval != 255 || depth != (alpha ? 4 : 3))
+		return false;
+	*layout = bgra ? RAW_BGRA : alpha ? RAW_RGBA : RAW_RGB;
+	*off = s - p;
+	return true;
+}
+
+static bool raw_header(const unsigned char *p, size_t len, fileformat_t format,
+                       size_t *off, int *w, int *h, rawlayout_t *layout)
+{
+	uint32_t fw, fh;
+
+	if (format == FMT_FARBFELD) {
+		if (len < 16)
+			return false;
+		fw = (uint32_t) p[8] << 24 | p[9] << 16 | p[10] << 8 | p[11];
+		fh = (uint32_t) p[12] << 24 | p[13] << 16 | p[14] << 8 | p[15];
+		if (fw > INT_MAX || fh > INT_MAX)
+			return false;
+		*w = fw;
+		*h = fh;
+		*off = 16;
+		*layout = RAW_RGBA16;
+	} else if (!pnm_header((const char*) p, len, off, w, h, layout)) {
+		return false;
+	}
+	return *w > 0 && *h > 0 &&
+	       (len - *off) / raw_bpp[*layout] / *w >= (size_t) *h;
+}
+
+#if RAW_SSSE3
+/* returns the number of pixels converted, the rest is left to raw_convert() */
+__attribute__((target("ssse3")))
+static size_t raw_convert_ssse3(DATA32 *dst, const unsigned char *src, size_t n,
+                                rawlayout_t layout)
+{
+	const __m128i a = _mm_set1_epi32((int) 0xff000000);
+	__m128i m0, m1, p;
+	size_t i = 0;
+
+	switch (layout) {
+	case RAW_RGB:
+		m0 = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+		/* 16 bytes are read for 4 pixels */
+		for (; i + 6 <= n; i += 4, src += 12) {
+			p = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) src), m0);
+			_mm_storeu_si128((__m128i*) (dst + i), _mm_or_si128(p, a));
+		}
+		break;
+	case RAW_RGBA:
+		m0 = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+		for (; i + 4 <= n; i += 4, src += 16) {
+			p = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) src), m0);
+			_mm_storeu_si128((__m128i*) (dst + i), p);
+		}
+		break;
+	case RAW_RGBA16:
+		/* the high bytes of the samples of 2 pixels into each half */
+		m0 = _mm_setr_epi8(4, 2, 0, 6, 12, 10, 8, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+		m1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 4, 2, 0, 6, 12, 10, 8, 14);
+		for (; i + 4 <= n; i += 4, src += 32) {
+			p = _mm_or_si128(
+			    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) src), m0),
+			    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + 16)), m1));
+			_mm_storeu_si128((__m128i*) (dst + i), p);
+		}
+		break;
+	case RAW_BGRA:
+		break;
+	}
+	return i;
+}
+#endif
+
+#if RAW_NEON
+static size_t raw_convert_neon(DATA32 *dst, const unsigned char *src, size_t n,
+                               rawlayout_t layout)
+{
+	uint8_t *d = (uint8_t*) dst;
+	uint8x16x4_t o;
+	uint8x16x3_t c3;
+	uint16x8x4_t c16;
+	uint8x8x4_t o8;
+	size_t i = 0;
+
+	switch (layout) {
+	case RAW_RGB:
+		o.val[3] = vdupq_n_u8(0xff);
+		for (; i + 16 <= n; i += 16, src += 48) {
+			c3 = vld3q_u8(src);
+			o.val[0] = c3.val[2];
+			o.val[1] = c3.val[1];
+			o.val[2] = c3.val[0];
+			vst4q_u8(d + 4 * i, o);
+		}
+		break;
+	case RAW_RGBA:
+		for (; i + 16 <= n; i += 16, src += 64) {
+			o = vld4q_u8(src);
+			c3.val[0] = o.val[0];
+			o.val[0] = o.val[2];
+			o.val[2] = c3.val[0];
+			vst4q_u8(d + 4 * i, o);
+		}
+		break;
+	case RAW_RGBA16:
+		/* the high byte of a big-endian sample is the low byte of the
+		 * little-endian load
+		 */
+		for (; i + 8 <= n; i += 8, src += 64) {
+			c16 = vld4q_u16((const uint16_t*) src);
+			o8.val[0] = vmovn_u16(c16.val[2]);
+			o8.val[1] = vmovn_u16(c16.val[1]);
+			o8.val[2] = vmovn_u16(c16.val[0]);
+			o8.val[3] = vmovn_u16(c16.val[3]);
+			vst4_u8(d + 4 * i, o8);
+		}
+		break;
+	case RAW_BGRA:
+		break;
+	}
+	return i;
+}
+#endif
+
+static void raw_convert(DATA32 *dst, const unsigned char *src, size_t n,
+                        rawlayout_t layout)
+{
+	size_t i = 0;
+
+#if RAW_SSSE3
+	if (__builtin_cpu_supports("ssse3"))
+		i = raw_convert_ssse3(dst, src, n, layout);
+#elif RAW_NEON
+	i = raw_convert_neon(dst, src, n, layout);
+#endif
+	src += i * raw_bpp[layout];
+
+	switch (layout) {
+	case RAW_RGB:
+		for (; i < n; i++, src += 3)
+			dst[i] = 0xffu << 24 | src[0] << 16 | src[1] << 8 | src[2];
+		break;
+	case RAW_RGBA:
+		for (; i < n; i++, src += 4)
+			dst[i] = (DATA32) src[3] << 24 | src[0] << 16 | src[1] << 8 | src[2];
+		break;
+	case RAW_RGBA16:
+		for (; i < n; i++, src += 8)
+			dst[i] = (DATA32) src[6] << 24 | src[0] << 16 | src[2] << 8 | src[4];
+		break;
+	case RAW_BGRA:
+		for (; i < n; i++, src += 4)
+			dst[i] = (DATA32) src[3] << 24 | src[2] << 16 | src[1] << 8 | src[0];
+		break;
+	}
+}
+
+static void raw_unmap(void *im, void *data)
+{
+	rawmap_t *m = (rawmap_t*) data;
+
+	munmap(m->addr, m->len);
+	free(m);
+}
+
+/* returns a copy of the image, if its pixels are the mapping of its file, which
+ * faults, when the file is truncated or rewritten; the image is then freed
+ */
+static Imlib_Image raw_unshare(Imlib_Image im)
+{
+	Imlib_Image copy;
+	DATA32 *data;
+	const char *fmt;
+	size_t size;
+	int w, h;
+
+	imlib_context_set_image(im);
+	if (imlib_image_get_attached_data("swiv-map") == NULL)
+		return im;
+	w = imlib_image_get_width();
+	h = imlib_image_get_height();
+	fmt = imlib_image_format();
+	size = (size_t) w * h * sizeof(DATA32);
+	data = (DATA32*) emalloc(size);
+	memcpy(data, imlib_image_get_data_for_reading_only(), size);
+	if ((copy = img_from_data(data, w, h, true)) == NULL)
+		error(EXIT_FAILURE, ENOMEM, NULL);
+	imlib_image_set_format(fmt);
+	imlib_context_set_image(im);
+	imlib_free_image();
+	imlib_context_set_image(copy);
+	return copy;
+}
+
+/* maps the file, returns NULL, if it is not a farbfeld, ppm or pam file, which
+ * is read this way
+ */
+static unsigned char* raw_map(const fileinfo_t *file, size_t *len, size_t *off,
+                              int *w, int *h, rawlayout_t *layout)
+{
+	struct stat st;
+	unsigned char *addr;
+	int fd;
+
+	if ((fd = open(file->path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uintmax_t) st.st_size > SIZE_MAX) {
+		close(fd);
+		return NULL;
+	}
+	*len = st.st_size;
+	/* writable to let imlib change the pixels, which are then private */
+	addr = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	if (!raw_header(addr, *len, file->meta.format, off, w, h, layout)) {
+		munmap(addr, *len);
+		return NULL;
+	}
+	return addr;
+}
+
+/* converts the mapped pixels and unmaps them */
+static DATA32* raw_read(unsigned char *addr, size_t len, size_t off, int w, int h,
+                        rawlayout_t layout)
+{
+	DATA32 *data;
+
+	data = emalloc((size_t) w * h * sizeof(DATA32));
+	posix_madvise(addr, len, POSIX_MADV_SEQUENTIAL);
+	raw_convert(data, addr + off, (size_t) w * h, layout);
+	munmap(addr, len);
+	return data;
+}
+
+/* opens farbfeld, ppm and pam files; the mapping stays attached to the image,
+ * if it holds the pixels, so that only the pages, which are used, are read
+ */
+static Imlib_Image img_open_raw(const fileinfo_t *file, int *w, int *h)
+{
+	Imlib_Image im = NULL;
+	const char *fmt;
+	rawlayout_t layout;
+	unsigned char *addr;
+	size_t len, off;
+
+	if ((addr = raw_map(file, &len, &off, w, h, &layout)) == NULL)
+		return NULL;
+	fmt = layout == RAW_RGBA16 ? "ff" : addr[1] == '6' ? "ppm" : "pam";
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (layout == RAW_BGRA && off % sizeof(DATA32) == 0 &&
+	    (im = imlib_create_image_using_data(*w, *h, (DATA32*) (addr + off))) != NULL)
+	{
+		rawmap_t *m = (rawmap_t*) emalloc(sizeof(rawmap_t));
+
+		m->addr = addr;
+		m->len = len;
+		imlib_context_set_image(im);
+		imlib_image_attach_data_value("swiv-map", m, 0, raw_unmap);
+		imlib_image_set_has_alpha(1);
+	} else
+#endif
+	{
+		im = img_from_data(raw_read(addr, len, off, *w, *h, layout), *w, *h,
+		                   layout != RAW_RGB);
+	}
+	if (im != NULL)
+		imlib_image_set_format(fmt);
+	return im;
+}
+
+/* opens the image at a reduced resolution, if it still covers the box bw x bh,
+ * which is the size the image is shown at; w and h are set to the full size
+ */
+Imlib_Image img_open(fileinfo_t *file, int bw, int bh, int *w, int *h)
+{
+	Imlib_Image im = NULL;
+	int fw, fh;
+
+	if (img_probe(file)) {
+		if (file->meta.format == FMT_FARBFELD || file->meta.format == FMT_PNM)
+			im = img_open_raw(file, &fw, &fh);
+#if HAVE_LIBJPEG
+		FILE *f;
+
+		if (file->meta.format == FMT_JPEG && (f = fopen(file->path, "rb")) != NULL) {
+			im = img_open_jpeg(f, bw, bh, &fw, &fh);
+			fclose(f);
+		}
+#endif
+		if (im == NULL && (im = imlib_load_image(file->path)) != NULL) {
+			imlib_context_set_image(im);
+			if (imlib_image_get_data_for_reading_only() == NULL) {
+				imlib_free_image();
+				im = NULL;
 			} else {
-				for (i = 0; i < h; i++)
-					DGifGetLine(gif, rows[i], w);
+				fw = imlib_image_get_width();
+				fh = imlib_image_get_height();
 			}
+		}
+	}
+	if (im == NULL && (file->flags & FF_WARN))
+		error(0, 0, "%s: Error opening image", file->name);
+	if (im != NULL) {
+		imlib_context_set_image(im);
+		if (w != NULL)
+			*w = fw;
+		if (h != NULL)
+			*h = fh;
+	}
+	return im;
+}
+
+/* whether img_read() can read the probed file */
+static bool img_readable(const fileinfo_t *file)
+{
+	return file->meta.format == FMT_FARBFELD || file->meta.format == FMT_PNM ||
+	       (HAVE_LIBJPEG && file->meta.format == FMT_JPEG);
+}
+
+/* reads the pixels of jpeg, farbfeld, ppm and pam files like img_open(), but
+ * without imlib, so that it can be called from any thread; w and h are set to
+ * the size of the pixels, the full size of downscaled jpegs is put into
+ * file->meta. Returns NULL for the other formats
+ */
+DATA32* img_read(fileinfo_t *file, int bw, int bh, int *w, int *h, bool *alpha)
+{
+	DATA32 *data = NULL;
+	rawlayout_t layout;
+	unsigned char *addr;
+	size_t len, off;
+#if HAVE_LIBJPEG
+	FILE *f;
+	int fw, fh;
+#endif
+
+	if (!img_probe(file))
+		return NULL;
+	if (file->meta.format == FMT_FARBFELD || file->meta.format == FMT_PNM) {
+		if ((addr = raw_map(file, &len, &off, w, h, &layout)) != NULL) {
+			data = raw_read(addr, len, off, *w, *h, layout);
+			*alpha = layout != RAW_RGB;
+		}
+	}
+#if HAVE_LIBJPEG
+	if (file->meta.format == FMT_JPEG && (f = fopen(file->path, "rb")) != NULL) {
+		if ((data = jpeg_decode(f, bw, bh, &fw, &fh, w, h)) != NULL) {
+			file->meta.w = fw;
+			file->meta.h = fh;
+		}
+		*alpha = false;
+		fclose(f);
+	}
+#endif
+	return data;
+}
+
+#if HAVE_LIBEXIF && HAVE_LIBJPEG
+/* reads the thumbnail embedded in the exif data of the file like img_read() */
+DATA32* img_read_preview(fileinfo_t *file, int *w, int *h)
+{
+	DATA32 *data = NULL;
+	FILE *f;
+	int fw, fh;
+
+	if (!img_probe(file) || file->meta.preview == 0)
+		return NULL;
+	if ((f = fopen(file->path, "rb")) != NULL) {
+		if (fseeko(f, file->meta.preview, SEEK_SET) == 0)
+			data = jpeg_decode(f, 0, 0, &fw, &fh, w, h);
+		fclose(f);
+	}
+	return data;
+}
+#endif
+
+#if HAVE_LIBEXIF
+/* opens the thumbnail embedded in the exif data of the file */
+Imlib_Image img_open_preview(fileinfo_t *file)
+{
+	Imlib_Image im = NULL;
+#if HAVE_LIBJPEG
+	DATA32 *data;
+	int w, h;
+#else
+	unsigned char *buf;
+	char tmppath[] = "/tmp/swiv-XXXXXX";
+	int fd, tmpfd;
+	bool err = true;
+#endif
+
+#if HAVE_LIBJPEG
+	if ((data = img_read_preview(file, &w, &h)) != NULL &&
+	    (im = img_from_data(data, w, h, false)) != NULL)
+	{
+		imlib_image_set_format("jpeg");
+	}
+#else
+	if (!img_probe(file) || file->meta.preview == 0)
+		return NULL;
+	buf = (unsigned char*) emalloc(file->meta.preview_len);
+	if ((fd = open(file->path, O_RDONLY)) >= 0) {
+		err = pread(fd, buf, file->meta.preview_len, file->meta.preview) !=
+		      file->meta.preview_len;
+		close(fd);
+	}
+	if (!err && (tmpfd = mkstemp(tmppath)) >= 0) {
+		err = write(tmpfd, buf, file->meta.preview_len) != file->meta.preview_len;
+		close(tmpfd);
+		if (!err && (im = imlib_load_image(tmppath)) != NULL) {
+			imlib_context_set_image(im);
+			imlib_image_set_changes_on_disk();
+		}
+		unlink(tmppath);
+	}
+	free(buf);
+#endif
+	return im;
+}
+#endif
+
+/* the size, at which the image is going to be shown, in the sense of
+ * img_covers(); unknown for SCALE_ZOOM, which needs the full resolution
+ */
+static void img_view_box(img_t *img, int *bw, int *bh)
+{
+	*bw = img->scalemode != SCALE_ZOOM && img->scalemode != SCALE_HEIGHT ?
+	      img->win->width : 0;
+	*bh = img->scalemode != SCALE_ZOOM && img->scalemode != SCALE_WIDTH ?
+	      img->win->height : 0;
+}
+
+static bool img_decode(img_t *img, fileinfo_t *file)
+{
+	const char *fmt;
+	int bw, bh, rot, tmp;
+	bool flip;
+
+	img_view_box(img, &bw, &bh);
+	if ((img->im = img_open(file, bw, bh, &img->w, &img->h)) == NULL)
+		return false;
+
+	imlib_image_set_changes_on_disk();
+
+	/* the pixels are oriented, when they are rendered */
+	exif_orientation(file, &flip, &rot);
+	if (rot & 1) {
+		tmp = img->w;
+		img->w = img->h;
+		img->h = tmp;
+	}
+
+	if ((fmt = imlib_image_format()) != NULL) {
+#if HAVE_GIFLIB
+		if (STREQ(fmt, "gif")) {
+			img_load_gif(img, file);
+			if (img->multi.cnt > 0) {
+				img->w = imlib_image_get_width();
+				img->h = imlib_image_get_height();
+			}
+		}
+#endif
+	}
+	return true;
+}
+
+/* decodes the image again at the resolution needed for the current zoom level */
+static void img_redecode(img_t *img)
+{
+	fileinfo_t file;
+	Imlib_Image im;
+	int bw, bh;
+
+	file.name = file.path = img->path;
+	file.flags = 0;
+	file.meta = img->meta;
+	bw = img->w * img->zoom + 0.5;
+	bh = img->h * img->zoom + 0.5;
+
+	if ((im = img_open(&file, bw, bh, NULL, NULL)) == NULL)
+		return;
+
+	imlib_context_set_image(img->im);
+	imlib_free_image();
+	img->im = im;
+	img->view.im = NULL;
+	imlib_context_set_image(img->im);
+}
+
+static void img_free_frames(Imlib_Image im, multi_img_t *multi, bool decache)
+{
+	int i;
+
+	if (multi->cnt > 0) {
+		for (i = 0; i < multi->cnt; i++) {
+			if (multi->frames[i].im != NULL) {
+				imlib_context_set_image(multi->frames[i].im);
+				imlib_free_image();
+			}
+			free(multi->frames[i].key);
+			free(multi->frames[i].pix);
+			free(multi->frames[i].lut);
+		}
+		multi->cnt = 0;
+#if HAVE_GIFLIB
+		if (multi->gif != NULL)
+			gif_free(multi->gif);
+#endif
+		multi->gif = NULL;
+	} else if (im != NULL) {
+		imlib_context_set_image(im);
+		if (decache)
+			imlib_free_image_and_decache();
+		else
+			imlib_free_image();
+	}
+}
+
+static void img_cache_drop(img_t *img, int n)
+{
+	img_slot_t *s = &img->cache.slots[n];
+
+	img_free_frames(s->im, &s->multi, true);
+	free(s->multi.frames);
+	free(s->path);
+	img->cache.size -= s->size;
+	img->cache.cnt--;
+	if (n < img->cache.cnt)
+		*s = img->cache.slots[img->cache.cnt];
+}
+
+/* returns the index of the cached image of path, images which were decoded
+ * before the file was changed are dropped
+ */
+static int img_cache_find(img_t *img, const char *path, time_t mtime)
+{
+	int i;
+
+	for (i = 0; i < img->cache.cnt; i++) {
+		if (STREQ(img->cache.slots[i].path, path)) {
+			if (img->cache.slots[i].mtime == mtime)
+				return i;
+			img_cache_drop(img, i);
+			break;
+		}
+	}
+	return -1;
+}
+
+/* takes ownership of the path, image and frames of src */
+static void img_cache_put(img_t *img, img_t *src)
+{
+	int i, lru;
+	img_slot_t *s;
+	multi_img_t *multi = &src->multi;
+
+	if ((i = img_cache_find(img, src->path, src->mtime)) >= 0)
+		img_cache_drop(img, i);
+
+	if (img->cache.cnt == img->cache.cap) {
+		img->cache.cap = img->cache.cap > 0 ? img->cache.cap * 2 : 8;
+		img->cache.slots = (img_slot_t*) erealloc(img->cache.slots,
+		                   img->cache.cap * sizeof(img_slot_t));
+	}
+	s = &img->cache.slots[img->cache.cnt++];
+	s->path = src->path;
+	s->mtime = src->mtime;
+	s->im = src->im;
+	s->w = src->w;
+	s->h = src->h;
+	s->multi = *multi;
+	s->used = ++img->cache.tick;
+	if (multi->gif != NULL) {
+		/* only the first frame is kept as an image */
+		for (i = 1; i < multi->cnt; i++) {
+			if (multi->frames[i].im != NULL) {
+				imlib_context_set_image(multi->frames[i].im);
+				imlib_free_image();
+				multi->frames[i].im = NULL;
+				multi->gif->size -= (size_t) multi->gif->w * multi->gif->h * 4;
+			}
+		}
+		s->size = multi->gif->size + multi->gif->len +
+		          (size_t) multi->gif->w * multi->gif->h * 4;
+	} else {
+		/* the file might change, while the image is cached */
+		s->im = raw_unshare(s->im);
+		s->size = (size_t) imlib_image_get_width() * imlib_image_get_height() * 4;
+	}
+	img->cache.size += s->size;
+
+	src->path = NULL;
+	src->im = NULL;
+	multi->frames = NULL;
+	multi->cap = multi->cnt = 0;
+	multi->gif = NULL;
+
+	while (img->cache.cnt > 0 && img->cache.size > (size_t) IMG_CACHE_SIZE << 20) {
+		for (lru = 0, i = 1; i < img->cache.cnt; i++) {
+			if (img->cache.slots[i].used < img->cache.slots[lru].used)
+				lru = i;
+		}
+		img_cache_drop(img, lru);
+	}
+}
+
+/* moves the cached image of file into img, the frame array of img is handed
+ * over to the cache slot and freed with it
+ */
+static bool img_cache_take(img_t *img, const fileinfo_t *file, time_t mtime)
+{
+	int n;
+	img_slot_t *s;
+	img_frame_t *frames;
+	int cap;
+
+	if ((n = img_cache_find(img, file->path, mtime)) < 0)
+		return false;
+
+	s = &img->cache.slots[n];
+	frames = img->multi.frames;
+	cap = img->multi.cap;
+
+	img->multi.frames = s->multi.frames;
+	img->multi.cap = s->multi.cap;
+	img->multi.cnt = s->multi.cnt;
+	img->multi.length = s->multi.length;
+	img->multi.gif = s->multi.gif;
+	img->multi.sel = 0;
+	img->im = s->im;
+	img->w = s->w;
+	img->h = s->h;
+
+	s->im = NULL;
+	s->multi.frames = frames;
+	s->multi.cap = cap;
+	s->multi.cnt = 0;
+	s->multi.gif = NULL;
+	img_cache_drop(img, n);
+
+#if HAVE_GIFLIB
+	/* the first frame might have been dropped from the frame cache */
+	if (img->multi.gif != NULL && (img->im = img_gif_frame(img, 0)) == NULL) {
+		img_free_frames(NULL, &img->multi, true);
+		return false;
+	}
+#endif
+	imlib_context_set_image(img->im);
+	return true;
+}
 
-			ptr = data = (DATA32*) emalloc(sizeof(DATA32) * sw * sh);
-			cmap = gif->Image.ColorMap ? gif->Image.ColorMap : gif->SColorMap;
-			r = cmap->Colors[bg].Red;
-			g = cmap->Colors[bg].Green;
-			b = cmap->Colors[bg].Blue;
-			bgpixel = 0x00ffffff & (r << 16 | g << 8 | b);
-
-			for (i = 0; i < sh; i++) {
-				for (j = 0; j < sw; j++) {
-					if (i < y || i >= y + h || j < x || j >= x + w ||
-					    rows[i-y][j-x] == transp)
-					{
-						if (prev_frame != NULL && (prev_disposal != 2 ||
-						    i < py || i >= py + ph || j < px || j >= px + pw))
-						{
-							*ptr = prev_frame[i * sw + j];
-						} else {
-							*ptr = bgpixel;
-						}
-					} else {
-						r = cmap->Colors[rows[i-y][j-x]].Red;
-						g = cmap->Colors[rows[i-y][j-x]].Green;
-						b = cmap->Colors[rows[i-y][j-x]].Blue;
-						*ptr = 0xffu << 24 | r << 16 | g << 8 | b;
-					}
-					ptr++;
-				}
-			}
+/* the orientation of the shown image relative to the decoded pixels: the exif
+ * orientation, followed by the flip and rotation done by the user, combined
+ * into a flip followed by a rotation
+ */
+static void img_orientation(const img_t *img, bool *flip, int *rot)
+{
+	fileinfo_t file;
 
-			im = imlib_create_image_using_copied_data(sw, sh, data);
+	file.meta = img->meta;
+	exif_orientation(&file, flip, rot);
+	*rot = img->orient.flip ? img->orient.rot - *rot : img->orient.rot + *rot;
+	*rot = (*rot + 4) % 4;
+	*flip = *flip != img->orient.flip;
+}
 
-			for (i = 0; i < h; i++)
-				free(rows[i]);
-			free(rows);
-			free(data);
+/* the size of img->im, when it is shown, which is made the current image */
+static void img_im_size(const img_t *img, int *w, int *h)
+{
+	bool flip;
+	int rot;
 
-			if (im == NULL) {
-				err = true;
-				break;
-			}
+	img_orientation(img, &flip, &rot);
+	imlib_context_set_image(img->im);
+	*w = rot & 1 ? imlib_image_get_height() : imlib_image_get_width();
+	*h = rot & 1 ? imlib_image_get_width() : imlib_image_get_height();
+}
 
-			imlib_context_set_image(im);
-			imlib_image_set_format("gif");
-			if (transp >= 0)
-				imlib_image_set_has_alpha(1);
+/* maps the rectangle x0, y0 - x1, y1 of the shown w x h image back into the
+ * pixels, which are shown with the orientation flip, rot
+ */
+static void img_unorient(int w, int h, bool flip, int rot,
+                         int *x0, int *y0, int *x1, int *y1)
+{
+	int i, tmp;
 
-			if (disposal != 3)
-				prev_frame = imlib_image_get_data_for_reading_only();
-			prev_disposal = disposal;
-			px = x, py = y, pw = w, ph = h;
+	for (i = 0; i < rot; i++) {
+		tmp = *x0;
+		*x0 = *y0;
+		*y0 = w - *x1;
+		*x1 = *y1;
+		*y1 = w - tmp;
+		tmp = w;
+		w = h;
+		h = tmp;
+	}
+	if (flip) {
+		tmp = *x0;
+		*x0 = w - *x1;
+		*x1 = w - tmp;
+	}
+}
 
-			if (img->multi.cnt == img->multi.cap) {
-				img->multi.cap *= 2;
-				img->multi.frames = (img_frame_t*)
-				                    erealloc(img->multi.frames,
-				                             img->multi.cap * sizeof(img_frame_t));
+static size_t img_tile_size(const img_level_t *lv, int n)
+{
+	return (size_t) MIN(TILE_SIZE, lv->w - n % lv->cols * TILE_SIZE) *
+	       MIN(TILE_SIZE, lv->h - n / lv->cols * TILE_SIZE) * 4;
+}
+
+static void img_pyr_free(img_t *img)
+{
+	int i, n;
+	img_level_t *lv;
+
+	for (i = 0; i < img->pyr.cnt; i++) {
+		lv = &img->pyr.levels[i];
+		for (n = 0; lv->tiles != NULL && n < lv->cols * lv->rows; n++) {
+			if (lv->tiles[n].im != NULL) {
+				imlib_context_set_image(lv->tiles[n].im);
+				imlib_free_image();
 			}
-			img->multi.frames[img->multi.cnt].im = im;
-			delay = img->multi.framedelay > 0 ? img->multi.framedelay : delay;
-			img->multi.frames[img->multi.cnt].delay = delay > 0 ? delay : DEF_GIF_DELAY;
-			img->multi.length += img->multi.frames[img->multi.cnt].delay;
-			img->multi.cnt++;
 		}
-	} while (rec != TERMINATE_RECORD_TYPE);
+		free(lv->tiles);
+	}
+	free(img->pyr.levels);
+	img->pyr.levels = NULL;
+	img->pyr.cnt = 0;
+	img->pyr.size = 0;
+}
 
-#if defined(GIFLIB_MAJOR) && GIFLIB_MAJOR >= 5 && GIFLIB_MINOR >= 1
-	DGifCloseFile(gif, NULL);
-#else
-	DGifCloseFile(gif);
-#endif
+static void img_pyr_build(img_t *img)
+{
+	int i, n, iw, ih, base;
+	img_level_t *lv;
 
-	if (err && (file->flags & FF_WARN))
-		error(0, 0, "%s: Corrupted gif file", file->name);
+	if (img->multi.cnt > 0 || (double) img->w * img->h < TILE_IMAGE_SIZE * 1e6)
+		return;
 
-	if (img->multi.cnt > 1) {
-		imlib_context_set_image(img->im);
-		imlib_free_image();
-		img->im = img->multi.frames[0].im;
-	} else if (img->multi.cnt == 1) {
-		imlib_context_set_image(img->multi.frames[0].im);
-		imlib_free_image();
-		img->multi.cnt = 0;
+	img_im_size(img, &iw, &ih);
+
+	/* the decoded image has to be one of the levels, finer levels can only be
+	 * decoded from jpeg files
+	 */
+	for (base = 0; base <= 3; base++) {
+		if (LEVEL_DIM(img->w, base) == iw && LEVEL_DIM(img->h, base) == ih)
+			break;
 	}
+	if (base > 3 || (base > 0 && !JPEG_CROP))
+		return;
 
-	imlib_context_set_image(img->im);
+	/* the coarsest level fits into a single tile */
+	for (n = base + 1; LEVEL_DIM(img->w, n - 1) > TILE_SIZE ||
+	                   LEVEL_DIM(img->h, n - 1) > TILE_SIZE; n++);
+
+	img->pyr.levels = (img_level_t*) emalloc(n * sizeof(img_level_t));
+	for (i = 0; i < n; i++) {
+		lv = &img->pyr.levels[i];
+		lv->w = LEVEL_DIM(img->w, i);
+		lv->h = LEVEL_DIM(img->h, i);
+		lv->cols = (lv->w + TILE_SIZE - 1) / TILE_SIZE;
+		lv->rows = (lv->h + TILE_SIZE - 1) / TILE_SIZE;
+		if (i != base) {
+			lv->tiles = (img_tile_t*) emalloc(lv->cols * lv->rows * sizeof(img_tile_t));
+			memset(lv->tiles, 0, lv->cols * lv->rows * sizeof(img_tile_t));
+		} else {
+			lv->tiles = NULL;
+		}
+	}
+	img->pyr.cnt = n;
+	img->pyr.base = base;
+}
 
-	return !err;
+/* scales a tile of a level coarser than the base level down from img->im; the
+ * small tiles are oriented right away
+ */
+static void img_tile_scale(img_t *img, int l, int n)
+{
+	img_level_t *lv = &img->pyr.levels[l];
+	int s = l - img->pyr.base;
+	int x0, y0, x1, y1, iw, ih, rot;
+	bool flip;
+
+	imlib_context_set_image(img->im);
+	iw = imlib_image_get_width();
+	ih = imlib_image_get_height();
+	x0 = n % lv->cols * TILE_SIZE;
+	y0 = n / lv->cols * TILE_SIZE;
+	x1 = MIN(x0 + TILE_SIZE, lv->w);
+	y1 = MIN(y0 + TILE_SIZE, lv->h);
+	img_orientation(img, &flip, &rot);
+	img_unorient(lv->w, lv->h, flip, rot, &x0, &y0, &x1, &y1);
+
+	lv->tiles[n].im = imlib_create_cropped_scaled_image(x0 << s, y0 << s,
+	                  MIN((x1 - x0) << s, iw - (x0 << s)),
+	                  MIN((y1 - y0) << s, ih - (y0 << s)), x1 - x0, y1 - y0);
+	if (lv->tiles[n].im != NULL) {
+		imlib_context_set_image(lv->tiles[n].im);
+		if (flip)
+			imlib_image_flip_horizontal();
+		if (rot != 0)
+			imlib_image_orientate(rot);
+		img->pyr.size += img_tile_size(lv, n);
+	}
 }
-#endif /* HAVE_GIFLIB */
 
-Imlib_Image img_open(const fileinfo_t *file)
+#if JPEG_CROP
+/* decodes the tiles c0 to c1 of a row of a level finer than the base level
+ * from the jpeg file in a single pass
+ */
+static void img_tile_decode(img_t *img, int l, int row, int c0, int c1)
 {
-	struct stat st;
-	Imlib_Image im = NULL;
+	img_level_t *lv = &img->pyr.levels[l];
+	img_tile_t *t;
+	Imlib_Image band;
+	bool flip;
+	int i, n, rot, x0, y0, x1, y1;
+
+	x0 = c0 * TILE_SIZE;
+	x1 = MIN((c1 + 1) * TILE_SIZE, lv->w);
+	y0 = row * TILE_SIZE;
+	y1 = MIN(y0 + TILE_SIZE, lv->h);
+	img_orientation(img, &flip, &rot);
+	img_unorient(lv->w, lv->h, flip, rot, &x0, &y0, &x1, &y1);
+
+	if ((band = img_jpeg_region(img->path, 1 << l, x0, y0, x1 - x0, y1 - y0)) == NULL)
+		return;
+	imlib_context_set_image(band);
+	if (flip)
+		imlib_image_flip_horizontal();
+	if (rot != 0)
+		imlib_image_orientate(rot);
+
+	for (i = c0; i <= c1; i++) {
+		n = row * lv->cols + i;
+		t = &lv->tiles[n];
+		t->im = imlib_create_cropped_image((i - c0) * TILE_SIZE, 0,
+		        MIN(TILE_SIZE, lv->w - i * TILE_SIZE),
+		        MIN(TILE_SIZE, lv->h - row * TILE_SIZE));
+		if (t->im != NULL)
+			img->pyr.size += img_tile_size(lv, n);
+	}
+	imlib_free_image();
+}
+#endif /* JPEG_CROP */
 
-	if (access(file->path, R_OK) == 0 &&
-	    stat(file->path, &st) == 0 && S_ISREG(st.st_mode))
-	{
-		im = imlib_load_image(file->path);
-		if (im != NULL) {
-			imlib_context_set_image(im);
-			if (imlib_image_get_data_for_reading_only() == NULL) {
-				imlib_free_image();
-				im = NULL;
+/* frees the least recently used tiles, until the tile cache fits into its
+ * budget, visible tiles are kept
+ */
+static void img_pyr_evict(img_t *img)
+{
+	int i, n, lru_l = 0, lru_n = 0;
+	img_level_t *lv;
+	img_tile_t *t, *lru;
+
+	while (img->pyr.size > (size_t) TILE_CACHE_SIZE << 20) {
+		lru = NULL;
+		for (i = 0; i < img->pyr.cnt; i++) {
+			lv = &img->pyr.levels[i];
+			for (n = 0; lv->tiles != NULL && n < lv->cols * lv->rows; n++) {
+				t = &lv->tiles[n];
+				if (t->im != NULL && t->used < img->pyr.tick &&
+				    (lru == NULL || t->used < lru->used))
+				{
+					lru = t;
+					lru_l = i;
+					lru_n = n;
+				}
 			}
 		}
+		if (lru == NULL)
+			break;
+		imlib_context_set_image(lru->im);
+		imlib_free_image();
+		lru->im = NULL;
+		img->pyr.size -= img_tile_size(&img->pyr.levels[lru_l], lru_n);
 	}
-	if (im == NULL && (file->flags & FF_WARN))
-		error(0, 0, "%s: Error opening image", file->name);
-	return im;
 }
 
-bool img_load(img_t *img, const fileinfo_t *file)
+/* renders the tiles of level l in the area of img->dst, when the image is at
+ * ox, oy
+ */
+static void img_pyr_render(img_t *img, int l, float ox, float oy)
 {
-	const char *fmt;
+	img_level_t *lv = &img->pyr.levels[l];
+	render_src_t src;
+	img_tile_t *t;
+	float zx, zy;
+	int c, r, n, c0, c1, r0, r1;
+	int x0, x1, y0, y1;
+
+	/* zoom level relative to the pixels of the level */
+	zx = img->zoom * img->w / lv->w;
+	zy = img->zoom * img->h / lv->h;
+
+	/* the tiles in the area of the window, which is drawn */
+	c0 = MAX(0, (int) ((img->dst.x - ox) / zx)) / TILE_SIZE;
+	c1 = MIN(lv->w - 1, (int) ((img->dst.x + img->dst.w - ox) / zx)) / TILE_SIZE;
+	r0 = MAX(0, (int) ((img->dst.y - oy) / zy)) / TILE_SIZE;
+	r1 = MIN(lv->h - 1, (int) ((img->dst.y + img->dst.h - oy) / zy)) / TILE_SIZE;
+
+	img->pyr.tick++;
+	imlib_context_set_anti_alias(1);
+	for (r = r0; r <= r1; r++) {
+		for (c = c0; c <= c1; c++) {
+			t = &lv->tiles[r * lv->cols + c];
+			t->used = img->pyr.tick;
+			if (t->im != NULL)
+				continue;
+#if JPEG_CROP
+			if (l < img->pyr.base) {
+				for (n = c; n < c1 && lv->tiles[r * lv->cols + n + 1].im == NULL; n++)
+					lv->tiles[r * lv->cols + n + 1].used = img->pyr.tick;
+				img_tile_decode(img, l, r, c, n);
+				c = n;
+				continue;
+			}
+#endif
+			img_tile_scale(img, l, r * lv->cols + c);
+		}
+	}
+	imlib_context_set_anti_alias(img->aa);
+	img_pyr_evict(img);
+
+	for (r = r0; r <= r1; r++) {
+		y0 = floorf(oy + r * TILE_SIZE * zy + 0.5);
+		y1 = floorf(oy + MIN((r + 1) * TILE_SIZE, lv->h) * zy + 0.5);
+		for (c = c0; c <= c1; c++) {
+			n = r * lv->cols + c;
+			x0 = floorf(ox + c * TILE_SIZE * zx + 0.5);
+			x1 = floorf(ox + MIN((c + 1) * TILE_SIZE, lv->w) * zx + 0.5);
+			if (lv->tiles[n].im == NULL) {
+				render_fill(&img->dst, x0, y0, x1 - x0, y1 - y0, img->dst.bg[0]);
+				continue;
+			}
+			imlib_context_set_image(lv->tiles[n].im);
+			src.data = imlib_image_get_data_for_reading_only();
+			src.w = imlib_image_get_width();
+			src.h = imlib_image_get_height();
+			src.alpha = imlib_image_has_alpha();
+			src.flip = false;
+			src.rot = 0;
+			src.x = x0;
+			src.y = y0;
+			src.zx = (float) (x1 - x0) / src.w;
+			src.zy = (float) (y1 - y0) / src.h;
+			render_image(&img->dst, &src);
+		}
+	}
+	imlib_context_set_image(img->im);
+}
 
-	if ((img->im = img_open(file)) == NULL)
-		return false;
+bool img_load(img_t *img, fileinfo_t *file)
+{
+	time_t mtime = img_probe(file) ? file->meta.mtime : 0;
 
-	imlib_image_set_changes_on_disk();
+	img->orient.rot = 0;
+	img->orient.flip = false;
+	/* a new image is rendered at full quality right away */
+	img->quick = false;
 
-#if HAVE_LIBEXIF
-	exif_auto_orientate(file);
-#endif
+	if (!img_cache_take(img, file, mtime) && !img_decode(img, file))
+		return false;
 
-	if ((fmt = imlib_image_format()) != NULL) {
-#if HAVE_GIFLIB
-		if (STREQ(fmt, "gif"))
-			img_load_gif(img, file);
-#endif
-	}
-	img->w = imlib_image_get_width();
-	img->h = imlib_image_get_height();
+	img->path = estrdup(file->path);
+	img->mtime = mtime;
+	img->meta = file->meta;
+	img->view.im = NULL;
+	img_pyr_build(img);
 	img->checkpan = true;
 	img->dirty = true;
 
@@ -340,23 +2029,163 @@ bool img_load(img_t *img, const fileinfo_t *file)
 
 CLEANUP void img_close(img_t *img, bool decache)
 {
-	int i;
+	int tmp;
+
+	img_pyr_free(img);
+	img->view.im = NULL;
+	if (img->im != NULL && img->path != NULL && !decache) {
+		/* the pixels were never rotated, only the size has to be */
+		if (img->orient.rot & 1) {
+			tmp = img->w;
+			img->w = img->h;
+			img->h = tmp;
+		}
+		img_cache_put(img, img);
+	} else {
+		img_free_frames(img->im, &img->multi, decache);
+		free(img->path);
+	}
+	img->path = NULL;
+	img->im = NULL;
+}
 
-	if (img->multi.cnt > 0) {
-		for (i = 0; i < img->multi.cnt; i++) {
-			imlib_context_set_image(img->multi.frames[i].im);
-			imlib_free_image();
+/* puts the images, which were read by the threads for prefetching, into the
+ * cache
+ */
+void img_collect(img_t *img)
+{
+	fileinfo_t file;
+	DATA32 *data;
+	img_t tmp;
+	int w, h, fw, fh, rot;
+	bool alpha, flip;
+
+	while (tns_read_done(&file, &data, &w, &h, &alpha)) {
+		img->pf.pending--;
+		if (img->path != NULL && STREQ(img->path, file.path)) {
+			/* it was loaded meanwhile */
+			free(data);
+			data = NULL;
 		}
-		img->multi.cnt = 0;
-		img->im = NULL;
-	} else if (img->im != NULL) {
+		memset(&tmp, 0, sizeof(tmp));
+		if (data == NULL || (tmp.im = img_from_data(data, w, h, alpha)) == NULL) {
+			free((void*) file.path);
+			continue;
+		}
+		/* the pixels of jpegs might be downscaled, the image has the full
+		 * size; they are oriented, when they are rendered
+		 */
+		fw = file.meta.w > 0 ? file.meta.w : w;
+		fh = file.meta.h > 0 ? file.meta.h : h;
+		exif_orientation(&file, &flip, &rot);
+		tmp.w = rot & 1 ? fh : fw;
+		tmp.h = rot & 1 ? fw : fh;
+		tmp.path = (char*) file.path;
+		tmp.mtime = file.meta.mtime;
+		img_cache_put(img, &tmp);
+	}
+	imlib_context_set_image(img->im);
+}
+
+/* decodes the next frame ahead of the current one of an animation, or queues
+ * the images in the prefetch window around files[sel], which are not in the
+ * cache, to be read by the threads; every image of the window is tried only
+ * once, in case the window does not fit into the cache. The window is only
+ * queued after the previous one is done, so that no image is read twice.
+ * The images, which only imlib can open, or all images without threads, are
+ * decoded one by every call instead.
+ * Returns false, if there was nothing left to do.
+ */
+bool img_prefetch(img_t *img, fileinfo_t *files, int cnt, int sel)
+{
+	int i, n = 0, bw, bh, fd;
+	fileinfo_t *want[PREFETCH_NEXT + PREFETCH_PREV + 1];
+	fileinfo_t file;
+	img_t tmp;
+
+#if HAVE_GIFLIB
+	/* the next frames of the animation come first */
+	for (i = 1; img->multi.gif != NULL && i <= GIF_AHEAD && i < img->multi.cnt; i++) {
+		n = (img->multi.sel + i) % img->multi.cnt;
+		if (img->multi.frames[n].im == NULL) {
+			img_gif_frame(img, n);
+			imlib_context_set_image(img->im);
+			return img->multi.frames[n].im != NULL;
+		}
+	}
+	n = 0;
+#endif
+	img_collect(img);
+	if (img->pf.pending > 0)
+		return false;
+
+	if (sel != img->pf.sel || cnt != img->pf.cnt) {
+		img->pf.sel = sel;
+		img->pf.cnt = cnt;
+		img->pf.done = 0;
+	}
+	for (i = 1; i <= PREFETCH_NEXT && sel + i < cnt; i++)
+		want[n++] = &files[sel + i];
+	for (i = 1; i <= PREFETCH_PREV && sel - i >= 0; i++)
+		want[n++] = &files[sel - i];
+
+	img_view_box(img, &bw, &bh);
+	while (img->pf.done < n) {
+		if (want[img->pf.done]->path == NULL || !img_probe(want[img->pf.done])) {
+			img->pf.done++;
+			continue;
+		}
+		file = *want[img->pf.done++];
+		if ((i = img_cache_find(img, file.path, file.meta.mtime)) >= 0) {
+			img->cache.slots[i].used = ++img->cache.tick;
+			continue;
+		}
+		/* errors are reported, when the image is actually loaded */
+		file.flags &= ~FF_WARN;
+
+		if (img_readable(&file) && (fd = tns_read(&file, bw, bh)) >= 0) {
+			img->pf.fd = fd;
+			img->pf.pending++;
+			continue;
+		}
+
+		memset(&tmp, 0, sizeof(tmp));
+		tmp.win = img->win;
+		tmp.scalemode = img->scalemode;
+		tmp.multi.framedelay = img->multi.framedelay;
+		if (img_decode(&tmp, &file)) {
+			tmp.path = estrdup(file.path);
+			tmp.mtime = file.meta.mtime;
+			img_cache_put(img, &tmp);
+		} else {
+			free(tmp.multi.frames);
+		}
+
 		imlib_context_set_image(img->im);
-		if (decache)
-			imlib_free_image_and_decache();
-		else
-			imlib_free_image();
-		img->im = NULL;
+		return true;
 	}
+	return false;
+}
+
+static void img_cache_free(img_t *img)
+{
+	while (img->cache.cnt > 0)
+		img_cache_drop(img, img->cache.cnt - 1);
+	free(img->cache.slots);
+	img->cache.slots = NULL;
+	img->cache.cap = 0;
+}
+
+CLEANUP void img_free(img_t *img)
+{
+	img_cache_free(img);
+	free(img->view.data);
+	img->view.data = NULL;
+	img->view.cap = 0;
+	free(img->lut.tab);
+	free(img->lut.done);
+	img->lut.tab = NULL;
+	img->lut.done = NULL;
 }
 
 void img_check_pan(img_t *img, bool moved)
@@ -419,12 +2248,166 @@ bool img_fit(img_t *img)
 	}
 }
 
+/* whether the view fits the current image, except maybe for its pixels */
+static bool img_view_valid(img_t *img, const render_src_t *src)
+{
+	return img->view.zoom == img->zoom &&
+	       fabsf(src->x - floorf(src->x) - img->view.fx) < 0.001 &&
+	       fabsf(src->y - floorf(src->y) - img->view.fy) < 0.001 &&
+	       img->view.rot == img->orient.rot && img->view.flip == img->orient.flip &&
+	       (img->view.filter == img->dst.filter ||
+	        (img->quick && img->aa && img->view.filter == ANTI_ALIAS_FILTER));
+}
+
+/* renders the part x, y, w, h of the window into the view */
+static void img_view_render(img_t *img, const render_src_t *src, int x, int y, int w, int h)
+{
+	render_dst_t *dst = &img->dst, saved = *dst;
+	render_src_t vs = *src;
+	int bx, by, l;
+
+	/* the origin of the view in the window */
+	bx = floorf(src->x) + img->view.x;
+	by = floorf(src->y) + img->view.y;
+
+	dst->data = img->view.data;
+	dst->stride = img->view.w;
+	dst->x = MAX(x - bx, 0);
+	dst->y = MAX(y - by, 0);
+	dst->w = MIN(x + w - bx, img->view.w) - dst->x;
+	dst->h = MIN(y + h - by, img->view.h) - dst->y;
+	dst->bgx -= bx;
+	dst->bgy -= by;
+	dst->lut = NULL;
+	dst->blend = false;
+	vs.x -= bx;
+	vs.y -= by;
+
+	/* the finest level of the pyramid, which is not upscaled */
+	for (l = 0; l + 1 < img->pyr.cnt && img->zoom * (2 << l) <= 1.0; l++);
+
+	if (dst->w > 0 && dst->h > 0) {
+		if (img->pyr.cnt > 0 && l != img->pyr.base)
+			img_pyr_render(img, l, vs.x, vs.y);
+		else
+			render_image(dst, &vs);
+	}
+	*dst = saved;
+}
+
+/* renders the view for the window area and the margin around it */
+static void img_view_build(img_t *img, const render_src_t *src)
+{
+	win_t *win = img->win;
+	int x0, y0, x1, y1, bx, by, mx, my;
+
+	bx = floorf(src->x);
+	by = floorf(src->y);
+	mx = win->width * VIEW_MARGIN / 100;
+	my = win->height * VIEW_MARGIN / 100;
+
+	render_bounds(src, &x0, &y0, &x1, &y1);
+	x0 = MAX(x0, -mx);
+	y0 = MAX(y0, -my);
+	x1 = MAX(MIN(x1, win->width + mx), x0);
+	y1 = MAX(MIN(y1, win->height + my), y0);
+
+	if ((size_t) (x1 - x0) * (y1 - y0) > img->view.cap) {
+		free(img->view.data);
+		img->view.cap = (size_t) (x1 - x0) * (y1 - y0);
+		img->view.data = (DATA32*) emalloc(img->view.cap * sizeof(DATA32));
+	}
+	img->view.x = x0 - bx;
+	img->view.y = y0 - by;
+	img->view.w = x1 - x0;
+	img->view.h = y1 - y0;
+	img->view.im = img->im;
+	img->view.zoom = img->zoom;
+	img->view.fx = src->x - bx;
+	img->view.fy = src->y - by;
+	img->view.rot = img->orient.rot;
+	img->view.flip = img->orient.flip;
+	img->view.filter = img->dst.filter;
+
+	img_view_render(img, src, x0, y0, x1 - x0, y1 - y0);
+}
+
+/* draws the part x, y, w, h of the window from the view, which is rendered
+ * again, if it is not valid or does not cover the part; the area around the
+ * image is filled with the window background
+ */
+static void img_draw(img_t *img, const render_src_t *src, int x, int y, int w, int h)
+{
+	win_t *win = img->win;
+	render_dst_t *dst = &img->dst;
+	int x0, y0, x1, y1, bx, by;
+	uint32_t bg;
+
+	dst->x = MAX(x, 0);
+	dst->y = MAX(y, 0);
+	dst->w = MIN(x + w, win->width) - dst->x;
+	dst->h = MIN(y + h, win->height) - dst->y;
+	if (dst->w <= 0 || dst->h <= 0)
+		return;
+	win_damage(win, dst->x, dst->y, dst->w, dst->h);
+
+	render_bounds(src, &x0, &y0, &x1, &y1);
+	bg = (uint32_t) (win->bg.a * 255 + 0.5) << 24 |
+	     (uint32_t) (win->bg.r * win->bg.a * 255 + 0.5) << 16 |
+	     (uint32_t) (win->bg.g * win->bg.a * 255 + 0.5) << 8 |
+	     (uint32_t) (win->bg.b * win->bg.a * 255 + 0.5);
+	render_fill(dst, 0, 0, win->width, y0, bg);
+	render_fill(dst, 0, y0, x0, y1 - y0, bg);
+	render_fill(dst, x1, y0, win->width - x1, y1 - y0, bg);
+	render_fill(dst, 0, y1, win->width, win->height - y1, bg);
+
+	x0 = MAX(x0, dst->x);
+	y0 = MAX(y0, dst->y);
+	x1 = MIN(x1, dst->x + dst->w);
+	y1 = MIN(y1, dst->y + dst->h);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	bx = floorf(src->x) + img->view.x;
+	by = floorf(src->y) + img->view.y;
+	if (img->view.im != img->im || !img_view_valid(img, src) ||
+	    x0 < bx || y0 < by || x1 > bx + img->view.w || y1 > by + img->view.h)
+	{
+		img_view_build(img, src);
+		bx = floorf(src->x) + img->view.x;
+		by = floorf(src->y) + img->view.y;
+	}
+	render_copy(dst, img->view.data + (size_t) (y0 - by) * img->view.w + x0 - bx,
+	            img->view.w, src->alpha, x0, y0, x1 - x0, y1 - y0);
+}
+
+/* the table of the current gamma step, which is filled in on first use */
+static const DATA8* img_gamma_lut(img_t *img)
+{
+	int i, n = img->gamma + GAMMA_RANGE;
+	DATA8 *lut = img->lut.tab + n * 256;
+	double range, g;
+
+	if (img->gamma == 0)
+		return NULL;
+	if (!img->lut.done[n]) {
+		range = img->gamma <= 0 ? 1.0 : GAMMA_MAX - 1.0;
+		g = 1.0 + img->gamma * (range / GAMMA_RANGE);
+		for (i = 0; i < 256; i++)
+			lut[i] = MIN(pow(i / 255.0, 1.0 / g) * 255.0, 255.0);
+		img->lut.done[n] = true;
+	}
+	return lut;
+}
+
 void img_render(img_t *img)
 {
 	win_t *win;
-	int sx, sy, sw, sh;
-	int dx, dy, dw, dh;
-	Imlib_Image bg;
+	render_dst_t *dst;
+	render_src_t src;
+	int x0, y0, x1, y1, dx, dy;
+	int iw, ih;
+	float z;
 
 	win = img->win;
 	img_fit(img);
@@ -434,80 +2417,102 @@ void img_render(img_t *img)
 		img->checkpan = false;
 	}
 
-	if (!img->dirty) {
+	dx = img->shift.x;
+	dy = img->shift.y;
+	img->shift.x = img->shift.y = 0;
+	if (abs(dx) >= win->width || abs(dy) >= win->height)
+		img->dirty = true;
+
+	if (!img->dirty && img->area.w == 0 && dx == 0 && dy == 0) {
 		return;
 	}
 
-	/* calculate source and destination offsets:
-	 *   - part of image drawn on full window, or
-	 *   - full image drawn on part of window
-	 */
-	if (img->x <= 0) {
-		sx = -img->x / img->zoom + 0.5;
-		sw = win->width / img->zoom;
-		dx = 0;
-		dw = win->width;
-	} else {
-		sx = 0;
-		sw = img->w;
-		dx = img->x;
-		dw = img->w * img->zoom;
-	}
-	if (img->y <= 0) {
-		sy = -img->y / img->zoom + 0.5;
-		sh = win->height / img->zoom;
-		dy = 0;
-		dh = win->height;
-	} else {
-		sy = 0;
-		sh = img->h;
-		dy = img->y;
+	img_im_size(img, &iw, &ih);
 
-		// might be a pixel short when using the int truncation in C.
-		dh = (int)round((double)img->h * (double)img->zoom);
+	/* the image was decoded at a reduced resolution, which is too low now */
+	if (img->multi.cnt == 0 && img->path != NULL && img->pyr.cnt == 0 &&
+	    ((iw < img->w && iw < img->w * img->zoom - 0.5) ||
+	     (ih < img->h && ih < img->h * img->zoom - 0.5)))
+	{
+		img_redecode(img);
+		img_im_size(img, &iw, &ih);
 	}
 
-	win_clear(win);
-
-	imlib_context_set_image(img->im);
-	imlib_context_set_anti_alias(img->aa);
-
-	bool has_alpha = imlib_image_has_alpha();
-
-	if ((bg = imlib_create_image(dw, dh)) == NULL)
-		error(EXIT_FAILURE, ENOMEM, NULL);
+	src.data = imlib_image_get_data_for_reading_only();
+	src.w = imlib_image_get_width();
+	src.h = imlib_image_get_height();
+	src.alpha = imlib_image_has_alpha();
+	img_orientation(img, &src.flip, &src.rot);
+	src.x = img->x;
+	src.y = img->y;
+	/* zoom level relative to the shown decoded pixels */
+	src.zx = img->zoom * img->w / iw;
+	src.zy = img->zoom * img->h / ih;
+
+	/* the image is scaled straight into the window buffer */
+	dst = &img->dst;
+	dst->data = win_get_data(win, &dst->stride, !img->dirty);
+	render_bounds(&src, &dst->bgx, &dst->bgy, &x1, &y1);
+	if (!img->aa)
+		dst->filter = FILTER_NEAREST;
+	else
+		dst->filter = img->quick ? INTERACTIVE_FILTER : ANTI_ALIAS_FILTER;
+	dst->blend = true;
+	if (img->alpha) {
+		dst->bg[0] = 0xFF666666;
+		dst->bg[1] = 0xFF999999;
+	} else {
+		dst->bg[0] = dst->bg[1] = 0xFFFFFFFF;
+	}
+	dst->lut = img_gamma_lut(img);
 
-	imlib_context_set_image(bg);
-	imlib_image_set_has_alpha(0);
-	uint32_t *data = imlib_image_get_data();
-	if (has_alpha && img->alpha) {
-		int i, c, r;
-		uint32_t col[2] = { 0xFF666666, 0xFF999999 };
-
-		for (r = 0; r < dh; r++) {
-			i = r * dw;
-			if (r == 0 || r == 8) {
-				for (c = 0; c < dw; c++)
-					data[i++] = col[!(c & 8) ^ !r];
-			} else {
-				memcpy(&data[i], &data[(r & 8) * dw], dw * sizeof(data[0]));
+	if (img->dirty) {
+		img_draw(img, &src, 0, 0, win->width, win->height);
+	} else {
+		if (dx != 0 || dy != 0) {
+			/* the image was moved by whole pixels, the rendered pixels
+			 * are moved along and only the uncovered strips are rendered
+			 */
+			dst->x = dst->y = 0;
+			dst->w = win->width;
+			dst->h = win->height;
+			render_move(dst, dx, dy);
+			win_damage(win, 0, 0, win->width, win->height);
+			if (dx != 0)
+				img_draw(img, &src, dx > 0 ? 0 : win->width + dx, 0, abs(dx), win->height);
+			if (dy != 0)
+				img_draw(img, &src, 0, dy > 0 ? 0 : win->height + dy, win->width, abs(dy));
+		}
+		if (img->area.w > 0) {
+			/* the changed pixels and the ones, which are filtered with them */
+			z = img->zoom;
+			x0 = floorf(img->x + (img->area.x - 1) * z) - 1;
+			y0 = floorf(img->y + (img->area.y - 1) * z) - 1;
+			x1 = ceilf(img->x + (img->area.x + img->area.w + 1) * z) + 1;
+			y1 = ceilf(img->y + (img->area.y + img->area.h + 1) * z) + 1;
+			/* the view only needs to be updated for the new pixels */
+			if (img->view.im != NULL && img->view.im != img->im &&
+			    img_view_valid(img, &src))
+			{
+				img_view_render(img, &src, x0, y0, x1 - x0, y1 - y0);
+				img->view.im = img->im;
 			}
+			img_draw(img, &src, x0, y0, x1 - x0, y1 - y0);
 		}
-	} else {
-		// set alpha to 0xFF, otherwise imlib_blend_image_onto_image won't work
-		memset(data, 0xFF, dh * dw * 4);
 	}
-	imlib_image_put_back_data(data);
-
-	imlib_blend_image_onto_image(img->im, 0, sx, sy, sw, sh, 0, 0, dw, dh);
-	imlib_context_set_color_modifier(NULL);
-
-	win_render_imlib_image(win, dx, dy);
-
-	imlib_free_image();
-	imlib_context_set_color_modifier(img->cmod);
+	win_put_back_data(win);
 
 	img->dirty = false;
+	img->area.w = 0;
+}
+
+bool img_refine(img_t *img)
+{
+	img->quick = false;
+	if (img->view.im == NULL || !img->aa || img->view.filter == ANTI_ALIAS_FILTER)
+		return false;
+	img->dirty = true;
+	return true;
 }
 
 bool img_fit_win(img_t *img, scalemode_t sm)
@@ -586,17 +2591,28 @@ bool img_pos(img_t *img, float x, float y)
 	ox = img->x;
 	oy = img->y;
 
+	/* whole pixels, so that the rendered image can be moved along */
+	if (!img->dirty) {
+		x = ox + roundf(x - ox);
+		y = oy + roundf(y - oy);
+	}
 	img->x = x;
 	img->y = y;
 
 	img_check_pan(img, true);
 
-	if (ox != img->x || oy != img->y) {
-		img->dirty = true;
-		return true;
-	} else {
+	if (ox == img->x && oy == img->y)
 		return false;
+
+	if (!img->dirty && img->x - ox == (int) (img->x - ox) &&
+	    img->y - oy == (int) (img->y - oy))
+	{
+		img->shift.x += img->x - ox;
+		img->shift.y += img->y - oy;
+	} else {
+		img->dirty = true;
 	}
+	return true;
 }
 
 bool img_move(img_t *img, float dx, float dy)
@@ -658,20 +2674,14 @@ bool img_pan_edge(img_t *img, direction_t dir)
 	}
 }
 
+/* the pixels are not touched, they are oriented when they are rendered */
 void img_rotate(img_t *img, degree_t d)
 {
-	int i, tmp;
+	int tmp;
 	float ox, oy;
 
-	imlib_context_set_image(img->im);
-	imlib_image_orientate(d);
+	img->orient.rot = (img->orient.rot + d) % 4;
 
-	for (i = 0; i < img->multi.cnt; i++) {
-		if (i != img->multi.sel) {
-			imlib_context_set_image(img->multi.frames[i].im);
-			imlib_image_orientate(d);
-		}
-	}
 	if (d == DEGREE_90 || d == DEGREE_270) {
 		ox = d == DEGREE_90  ? img->x : img->win->width - img->x - img->w * img->zoom;
 		oy = d == DEGREE_270 ? img->y : img->win->height - img->y - img->h * img->zoom;
@@ -684,31 +2694,40 @@ void img_rotate(img_t *img, degree_t d)
 		img->h = tmp;
 		img->checkpan = true;
 	}
+	if (img->pyr.cnt > 0) {
+		img_pyr_free(img);
+		img_pyr_build(img);
+	}
 	img->dirty = true;
 }
 
 void img_flip(img_t *img, flipdir_t d)
 {
-	int i;
-	void (*imlib_flip_op[3])(void) = {
-		imlib_image_flip_horizontal,
-		imlib_image_flip_vertical,
-		imlib_image_flip_diagonal
-	};
+	int tmp;
 
 	d = (d & (FLIP_HORIZONTAL | FLIP_VERTICAL)) - 1;
 
-	if (d < 0 || d >= ARRLEN(imlib_flip_op))
+	if (d < 0 || d > 2)
 		return;
 
-	imlib_context_set_image(img->im);
-	imlib_flip_op[d]();
-
-	for (i = 0; i < img->multi.cnt; i++) {
-		if (i != img->multi.sel) {
-			imlib_context_set_image(img->multi.frames[i].im);
-			imlib_flip_op[d]();
-		}
+	/* horizontal flip after rotation by r equals rotation by -r after flip,
+	 * vertical flip = flip + 180 degrees, diagonal flip = 90 degrees + flip
+	 */
+	if (d == 1)
+		img->orient.rot += 2;
+	else if (d == 2)
+		img->orient.rot += 1;
+	img->orient.rot = (4 - img->orient.rot % 4) % 4;
+	img->orient.flip = !img->orient.flip;
+	if (d == 2) {
+		tmp = img->w;
+		img->w = img->h;
+		img->h = tmp;
+		img->checkpan = true;
+	}
+	if (img->pyr.cnt > 0) {
+		img_pyr_free(img);
+		img_pyr_build(img);
 	}
 	img->dirty = true;
 }
@@ -728,7 +2747,6 @@ bool img_change_gamma(img_t *img, int d)
 	 * d > 0: increase gamma
 	 */
 	int gamma;
-	double range;
 
 	if (d == 0)
 		gamma = 0;
@@ -736,11 +2754,6 @@ bool img_change_gamma(img_t *img, int d)
 		gamma = MIN(MAX(img->gamma + d, -GAMMA_RANGE), GAMMA_RANGE);
 
 	if (img->gamma != gamma) {
-		imlib_reset_color_modifier();
-		if (gamma != 0) {
-			range = gamma <= 0 ? 1.0 : GAMMA_MAX - 1.0;
-			imlib_modify_color_modifier_gamma(1.0 + gamma * (range / GAMMA_RANGE));
-		}
 		img->gamma = gamma;
 		img->dirty = true;
 		return true;
@@ -751,15 +2764,62 @@ bool img_change_gamma(img_t *img, int d)
 
 bool img_frame_goto(img_t *img, int n)
 {
-	if (n < 0 || n >= img->multi.cnt || n == img->multi.sel)
+	int sel = img->multi.sel;
+
+	if (n < 0 || n >= img->multi.cnt || n == sel)
 		return false;
 
 	img->multi.sel = n;
+#if HAVE_GIFLIB
+	if (img_gif_frame(img, n) == NULL) {
+		img->multi.sel = sel;
+		return false;
+	}
+#endif
 	img->im = img->multi.frames[n].im;
 
 	imlib_context_set_image(img->im);
-	img->w = imlib_image_get_width();
-	img->h = imlib_image_get_height();
+#if HAVE_GIFLIB
+	/* a later frame of a gif only differs in the areas of the frames up to it
+	 * and the one of the current frame, if that is disposed; frames, which
+	 * were skipped without being drawn, have no area
+	 */
+	if (img->multi.gif != NULL && n > sel && !img->dirty &&
+	    img->orient.rot == 0 && !img->orient.flip)
+	{
+		img_frame_t *f;
+		int i, x0, y0, x1, y1;
+
+		x0 = y0 = INT_MAX;
+		x1 = y1 = 0;
+		for (i = img->multi.frames[sel].disposal >= 2 ? sel : sel + 1; i <= n; i++) {
+			f = &img->multi.frames[i];
+			if (f->w > 0 && f->h > 0) {
+				x0 = MIN(x0, f->x);
+				y0 = MIN(y0, f->y);
+				x1 = MAX(x1, f->x + f->w);
+				y1 = MAX(y1, f->y + f->h);
+			}
+		}
+		if (x0 > x1) {
+			x0 = y0 = 0;
+			x1 = y1 = 1;
+		}
+		if (img->area.w > 0) {
+			x0 = MIN(x0, img->area.x);
+			y0 = MIN(y0, img->area.y);
+			x1 = MAX(x1, img->area.x + img->area.w);
+			y1 = MAX(y1, img->area.y + img->area.h);
+		}
+		img->area.x = x0;
+		img->area.y = y0;
+		img->area.w = MAX(x1 - x0, 1);
+		img->area.h = MAX(y1 - y0, 1);
+		return true;
+	}
+#endif
+	img_im_size(img, &img->w, &img->h);
+	img->view.im = NULL;
 	img->checkpan = true;
 	img->dirty = true;
 
@@ -780,15 +2840,15 @@ bool img_frame_navigate(img_t *img, int d)
 	return img_frame_goto(img, d);
 }
 
-bool img_frame_animate(img_t *img)
+/* advances the animation by d frames, wrapping around at its end; the frames
+ * skipped by a late animation are only drawn onto the canvas of the gif, the
+ * one shown is the only one made an image, and only the union of their areas
+ * is redrawn, unless the animation wraps around
+ */
+bool img_frame_animate(img_t *img, int d)
 {
-	if (img->multi.cnt == 0)
+	if (img->multi.cnt == 0 || d <= 0)
 		return false;
 
-	if (img->multi.sel + 1 >= img->multi.cnt)
-		img_frame_goto(img, 0);
-	else
-		img_frame_goto(img, img->multi.sel + 1);
-	img->dirty = true;
-	return true;
+	return img_frame_goto(img, (img->multi.sel + d) % img->multi.cnt);
 }
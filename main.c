@@ -43,8 +43,11 @@ typedef struct {
 } timeout_t;
 
 /* timeout handler functions: */
-void animate(void);
 void slideshow(void);
+void refine(void);
+
+void anim_start(void);
+void anim_stop(void);
 
 appmode_t mode;
 arl_t arl;
@@ -64,6 +67,18 @@ struct {
 	unsigned int sh;
 } repeat_key;
 
+/* animation frames are due at absolute deadlines on the monotonic clock, so
+ * that the time spent on showing them does not add up; the timer only marks a
+ * frame as due, which frame is shown is decided, when the compositor asks for
+ * the next one, skipping the frames, whose time has passed meanwhile
+ */
+struct {
+	int fd;
+	bool active;
+	bool due;
+	struct timespec next;
+} anim;
+
 int prefix;
 bool extprefix;
 
@@ -85,8 +100,8 @@ struct {
 } keyhandler;
 
 timeout_t timeouts[] = {
-	{ { 0, 0 }, false, animate      },
 	{ { 0, 0 }, false, slideshow    },
+	{ { 0, 0 }, false, refine       },
 };
 
 cursor_t imgcursor[3] = {
@@ -96,6 +111,7 @@ cursor_t imgcursor[3] = {
 void cleanup(void)
 {
 	img_close(&img, false);
+	img_free(&img);
 	arl_cleanup(&arl);
 	tns_free(&tns);
 	win_close(&win);
@@ -146,6 +162,9 @@ void remove_file(int n, bool manual)
 		free((void*) files[n].path);
 	free((void*) files[n].name);
 
+	if (tns.thumbs != NULL)
+		tns_unload(&tns, n);
+
 	if (n + 1 < filecnt) {
 		if (tns.thumbs != NULL) {
 			memmove(tns.thumbs + n, tns.thumbs + n + 1, (filecnt - n - 1) *
@@ -313,10 +332,7 @@ void load_image(int new)
 	open_info();
 	arl_setup(&arl, files[fileidx].path);
 
-	if (img.multi.cnt > 0 && img.multi.animate)
-		set_timeout(animate, img.multi.frames[img.multi.sel].delay, true);
-	else
-		reset_timeout(animate);
+	anim_start();
 }
 
 bool mark_image(int n, bool on)
@@ -434,12 +450,58 @@ void redraw(void)
 	win_draw(&win);
 }
 
+static void anim_arm(void)
+{
+	struct itimerspec t = { { 0, 0 }, anim.next };
+
+	if (timerfd_settime(anim.fd, TFD_TIMER_ABSTIME, &t, NULL) < 0)
+		error(EXIT_FAILURE, errno, "timerfd_settime: animation");
+}
+
+/* the current frame is shown for its delay from now on */
+void anim_start(void)
+{
+	if (anim.fd < 0 || img.multi.cnt == 0 || !img.multi.animate) {
+		anim_stop();
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &anim.next);
+	TS_ADD_MSEC(&anim.next, img.multi.frames[img.multi.sel].delay);
+	anim.active = true;
+	anim.due = false;
+	anim_arm();
+}
+
+void anim_stop(void)
+{
+	struct itimerspec zero_value = { { 0, 0 }, { 0, 0 } };
+
+	if (anim.active)
+		timerfd_settime(anim.fd, 0, &zero_value, NULL);
+	anim.active = anim.due = false;
+}
+
+/* advances to the frame, which is due now */
 void animate(void)
 {
-	if (img_frame_animate(&img)) {
-		win.redraw = true;
-		set_timeout(animate, img.multi.frames[img.multi.sel].delay, true);
+	struct timespec now;
+	int d = 0, sel = img.multi.sel;
+
+	anim.due = false;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	/* after a stall of more than one loop, e.g. while the window was hidden,
+	 * the animation continues from now
+	 */
+	if (TS_DIFF(&now, &anim.next) > img.multi.length)
+		anim.next = now;
+	while (!TS_BEFORE(&now, &anim.next)) {
+		sel = (sel + 1) % img.multi.cnt;
+		TS_ADD_MSEC(&anim.next, img.multi.frames[sel].delay);
+		d++;
 	}
+	if (img_frame_animate(&img, d))
+		win.redraw = true;
+	anim_arm();
 }
 
 void slideshow(void)
@@ -448,6 +510,24 @@ void slideshow(void)
 	win.redraw = true;
 }
 
+void refine(void)
+{
+	if (img_refine(&img))
+		win.redraw = true;
+}
+
+/* while the image is panned or zoomed continuously, it is rendered at
+ * interactive quality, until no input arrived for TO_REFINE; every input
+ * postpones the refinement. Called by the commands, which do it
+ */
+void interact(void)
+{
+	if (mode == MODE_IMAGE) {
+		img.quick = true;
+		set_timeout(refine, TO_REFINE, true);
+	}
+}
+
 void run_key_handler(const char *key, uint32_t mask)
 {
 	pid_t pid;
@@ -487,9 +567,7 @@ void run_key_handler(const char *key, uint32_t mask)
 	win_set_cursor(&win, CURSOR_WATCH);
 
 	// We're redrawing the bar manually here
-	wl_surface_attach(win.surface, win.buffer.wl_buf, 0, 0);
-	wl_surface_damage_buffer(win.surface, 0, win.height, win.width, win.bar.h);
-	wl_surface_commit(win.surface);
+	win_commit(&win);
 	wl_display_dispatch(win.display);
 	wl_display_flush(win.display);
 
@@ -776,6 +854,9 @@ void wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time)
 	cb = wl_surface_frame(win->surface);
 	wl_callback_add_listener(cb, &wl_surface_frame_listener, data);
 
+	if (anim.due && mode == MODE_IMAGE)
+		animate();
+
 	if (win->resized) {
 		if (mode == MODE_IMAGE) {
 			img.dirty = true;
@@ -792,21 +873,16 @@ void wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time)
 	} else if (win->redraw) {
 		redraw();
 		win->redraw = false;
-	} else {
-		wl_surface_commit(win->surface);
-		return;
 	}
-	wl_surface_attach(win->surface, win->buffer.wl_buf, 0, 0);
-	wl_surface_damage_buffer(win->surface, 0, 0, win->width,
-			win->height + win->bar.h);
-	wl_surface_commit(win->surface);
+	/* only commits the surface, if nothing was drawn */
+	win_commit(win);
 }
 
 const struct timespec ten_ms = {0, 10000000};
 
 void run(void)
 {
-	bool init_thumb, load_thumb, to_set;
+	bool load_thumb, prefetch, to_set;
 	struct timeval timeout;
 	fd_set fds;
 	int nfds, wl_fd;
@@ -821,20 +897,18 @@ void run(void)
 		error(EXIT_FAILURE, errno, " wl_display_dispatch_pending");
 
 	while (!win.quit) {
-		init_thumb = mode == MODE_THUMB && tns.initnext < filecnt;
-		load_thumb = mode == MODE_THUMB && tns.loadnext < tns.end;
-		if (load_thumb) {
-			if (!tns_load(&tns, tns.loadnext, false, false)) {
-				remove_file(tns.loadnext, false);
-				tns.dirty = true;
-			}
-			win.redraw = true;
-		} else if (init_thumb) {
-			if (!tns_load(&tns, tns.initnext, false, true))
-				remove_file(tns.initnext, false);
-		}
+		load_thumb = mode == MODE_THUMB && tns_schedule(&tns);
+
+		/* decode neighbouring images only after the current one is shown */
+		prefetch = mode == MODE_IMAGE && !win.redraw && !win.resized &&
+		           img_prefetch(&img, files, filecnt, fileidx);
 
 		to_set = check_timeouts(&timeout);
+		if (prefetch || load_thumb) {
+			/* only poll for events, there might be more to prefetch */
+			timeout.tv_sec = timeout.tv_usec = 0;
+			to_set = true;
+		}
 		FD_ZERO(&fds);
 		FD_SET(wl_fd, &fds);
 		nfds = wl_fd;
@@ -843,6 +917,18 @@ void run(void)
 			FD_SET(repeat_key.fd, &fds);
 			nfds = MAX(nfds, repeat_key.fd);
 		}
+		if (anim.active) {
+			FD_SET(anim.fd, &fds);
+			nfds = MAX(nfds, anim.fd);
+		}
+		if (mode == MODE_THUMB && tns.fd != -1) {
+			FD_SET(tns.fd, &fds);
+			nfds = MAX(nfds, tns.fd);
+		}
+		if (mode == MODE_IMAGE && img.pf.fd != -1) {
+			FD_SET(img.pf.fd, &fds);
+			nfds = MAX(nfds, img.pf.fd);
+		}
 		if (info.fd != -1) {
 			FD_SET(info.fd, &fds);
 			nfds = MAX(nfds, info.fd);
@@ -877,6 +963,21 @@ void run(void)
 			}
 		}
 
+		if (anim.active && FD_ISSET(anim.fd, &fds)) {
+			uint64_t expiration_count;
+
+			if (read(anim.fd, &expiration_count, sizeof(expiration_count)) > 0)
+				anim.due = true;
+		}
+
+		if (mode == MODE_THUMB && tns.fd != -1 && FD_ISSET(tns.fd, &fds) &&
+		    tns_collect(&tns))
+		{
+			win.redraw = true;
+		}
+		if (mode == MODE_IMAGE && img.pf.fd != -1 && FD_ISSET(img.pf.fd, &fds))
+			img_collect(&img);
+
 		if (info.fd != -1 && FD_ISSET(info.fd, &fds))
 			read_info();
 
@@ -1032,6 +1133,10 @@ int main(int argc, char **argv)
 	}
 	info.fd = -1;
 
+	anim.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (anim.fd < 0)
+		error(0, errno, "Failed to create timerfd, can't play animations");
+
 	if (options->thumb_mode) {
 		mode = MODE_THUMB;
 		tns_init(&tns, files, &filecnt, &fileidx, &win);
@@ -0,0 +1,761 @@
+/* Copyright 2023 Shaqeel Ahmad
+ *
+ * This file is part of swiv.
+ *
+ * swiv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * swiv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with swiv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "swiv.h"
+#define _RENDER_CONFIG
+#include "config.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#define RENDER_SSE2 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define RENDER_AVX2 1
+#endif
+#elif defined(__ARM_NEON)
+#define RENDER_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* the images are scaled, color corrected and blended onto their background in
+ * a single pass, which writes straight into the destination pixels. The smooth
+ * filters are separable: the source rows are filtered horizontally into a ring
+ * of rows, from which the destination rows are filtered vertically. The
+ * destination rows are split into bands, which are rendered in parallel.
+ */
+
+enum {
+	PREC        = 14,       /* bits of the fraction of the filter weights */
+	MAX_THREADS = 32,
+	MIN_BAND    = 1 << 15   /* pixels, below which an area is not split */
+};
+
+#define CH(p,s) ((p) >> (s) & 0xFF)
+
+/* x / 255 for x <= 255 * 255, rounded */
+#define DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+/* destination pixel i along one axis is the sum of the source pixels
+ * start[i] ... start[i]+taps-1, weighted by w[i*taps] ... w[i*taps+taps-1]
+ */
+typedef struct {
+	int *start;
+	int16_t *w;
+	int taps;
+} axis_t;
+
+typedef struct {
+	render_dst_t *dst;
+	const render_src_t *src;
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+	axis_t h;
+	axis_t v;
+	int bands;
+	uint32_t *rows;   /* v.taps + 1 rows per band */
+
+	/* pixel u, v of the oriented source is base[u * du + v * dv]; source
+	 * rows, which are not contiguous, are gathered into a line per band
+	 */
+	const uint32_t *base;
+	ptrdiff_t du;
+	ptrdiff_t dv;
+	uint32_t *lines;
+	int lw;
+} job_t;
+
+static void (*hfilter)(uint32_t*, const uint32_t*, const axis_t*, int);
+static void (*vfilter)(uint32_t*, const uint32_t**, const int16_t*, int, int);
+
+/* the pool and the scratch memory are used by one call of render_image() at a
+ * time, concurrent calls from other threads render on their own
+ */
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t use;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	int cnt;
+	unsigned long gen;
+	job_t *job;
+	int next;
+	int finished;
+} pool = {
+	.once = PTHREAD_ONCE_INIT,
+	.use  = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER
+};
+
+/* filter tables and rows, kept between the calls */
+static struct {
+	void *data;
+	size_t size;
+} scratch;
+
+void render_bounds(const render_src_t *src, int *x0, int *y0, int *x1, int *y1)
+{
+	int w = src->rot & 1 ? src->h : src->w;
+	int h = src->rot & 1 ? src->w : src->h;
+
+	*x0 = floorf(src->x + 0.5);
+	*y0 = floorf(src->y + 0.5);
+	*x1 = floorf(src->x + w * src->zx + 0.5);
+	*y1 = floorf(src->y + h * src->zy + 0.5);
+}
+
+static double filter_support(filter_t f)
+{
+	switch (f) {
+		case FILTER_LANCZOS:
+			return 3.0;
+		case FILTER_BILINEAR:
+			return 1.0;
+		default:
+			return 0.5;
+	}
+}
+
+static double filter_weight(filter_t f, double t)
+{
+	t = fabs(t);
+	switch (f) {
+		case FILTER_LANCZOS:
+			if (t < 1e-6)
+				return 1.0;
+			if (t >= 3.0)
+				return 0.0;
+			return 3.0 * sin(M_PI * t) * sin(M_PI * t / 3.0) / (M_PI * M_PI * t * t);
+		case FILTER_BILINEAR:
+			return t < 1.0 ? 1.0 - t : 0.0;
+		default:
+			return t <= 0.5 ? 1.0 : 0.0;
+	}
+}
+
+/* the number of weights per destination pixel, if n source pixels are scaled
+ * by z; the filters are widened by 1/z when scaling down
+ */
+static int axis_taps(filter_t f, float z, int n)
+{
+	if (f == FILTER_NEAREST)
+		return 1;
+	return MIN(n, (int) ceil(2.0 * filter_support(f) * MAX(1.0 / z, 1.0)) + 2);
+}
+
+/* fills the table of the destination pixels d ... d+dn-1, where the n source
+ * pixels start at o and are scaled by z
+ */
+static void axis_init(axis_t *a, filter_t f, int d, int dn, float o, float z, int n)
+{
+	double u, s, r, sum, wf[a->taps];
+	int i, k, lo, hi, sw, max;
+	int16_t *w;
+
+	s = MAX(1.0 / z, 1.0);
+	r = filter_support(f) * s;
+
+	for (i = 0; i < dn; i++) {
+		/* the center of the destination pixel in the source */
+		u = (d + i + 0.5 - o) / z;
+		if (f == FILTER_NEAREST) {
+			a->start[i] = MIN(MAX((int) floor(u), 0), n - 1);
+			continue;
+		}
+		lo = MAX((int) ceil(u - r - 0.5), 0);
+		hi = MIN((int) floor(u + r - 0.5), n - 1);
+		hi = MIN(hi, lo + a->taps - 1);
+
+		sum = 0.0;
+		for (k = lo; k <= hi; k++)
+			sum += wf[k - lo] = filter_weight(f, (k + 0.5 - u) / s);
+		if (sum <= 0.0) {
+			lo = hi = MIN(MAX((int) floor(u), 0), n - 1);
+			wf[0] = sum = 1.0;
+		}
+
+		a->start[i] = MIN(lo, n - a->taps);
+		w = a->w + (size_t) i * a->taps;
+		memset(w, 0, a->taps * sizeof(*w));
+		sw = 0;
+		max = lo - a->start[i];
+		for (k = lo; k <= hi; k++) {
+			w[k - a->start[i]] = lround(wf[k - lo] / sum * (1 << PREC));
+			sw += w[k - a->start[i]];
+			if (w[k - a->start[i]] > w[max])
+				max = k - a->start[i];
+		}
+		/* the rounded weights have to add up to exactly 1 */
+		w[max] += (1 << PREC) - sw;
+	}
+}
+
+static inline uint32_t pack_pixel(int32_t b, int32_t g, int32_t r, int32_t a)
+{
+	b = MIN(MAX(b >> PREC, 0), 255);
+	g = MIN(MAX(g >> PREC, 0), 255);
+	r = MIN(MAX(r >> PREC, 0), 255);
+	a = MIN(MAX(a >> PREC, 0), 255);
+	return (uint32_t) a << 24 | (uint32_t) r << 16 | (uint32_t) g << 8 | (uint32_t) b;
+}
+
+static void hfilter_c(uint32_t *out, const uint32_t *in, const axis_t *a, int n)
+{
+	const int16_t *w;
+	const uint32_t *p;
+	int32_t b, g, r, al;
+	int i, k;
+
+	for (i = 0, w = a->w; i < n; i++, w += a->taps) {
+		p = in + a->start[i];
+		b = g = r = al = 1 << (PREC - 1);
+		for (k = 0; k < a->taps; k++) {
+			b += w[k] * (int32_t) CH(p[k], 0);
+			g += w[k] * (int32_t) CH(p[k], 8);
+			r += w[k] * (int32_t) CH(p[k], 16);
+			al += w[k] * (int32_t) CH(p[k], 24);
+		}
+		out[i] = pack_pixel(b, g, r, al);
+	}
+}
+
+static void vfilter_c(uint32_t *out, const uint32_t **rows, const int16_t *w,
+                      int taps, int n)
+{
+	int32_t b, g, r, al;
+	uint32_t p;
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		b = g = r = al = 1 << (PREC - 1);
+		for (k = 0; k < taps; k++) {
+			p = rows[k][i];
+			b += w[k] * (int32_t) CH(p, 0);
+			g += w[k] * (int32_t) CH(p, 8);
+			r += w[k] * (int32_t) CH(p, 16);
+			al += w[k] * (int32_t) CH(p, 24);
+		}
+		out[i] = pack_pixel(b, g, r, al);
+	}
+}
+
+/* the simd kernels compute the same sums as the ones above, they only leave
+ * the pixels at the end of the rows to them
+ */
+#define VFILTER_TAIL(f, out, rows, w, taps, n, i) \
+	do { \
+		int k_; \
+		for (k_ = 0; k_ < (taps); k_++) \
+			(rows)[k_] += (i); \
+		f((out) + (i), (rows), (w), (taps), (n) - (i)); \
+		for (k_ = 0; k_ < (taps); k_++) \
+			(rows)[k_] -= (i); \
+	} while (0)
+
+#if RENDER_SSE2
+/* the weights of two taps in every 32 bit lane, for _mm_madd_epi16() */
+#define WPAIR(w0,w1) ((int32_t) ((uint32_t) (uint16_t) (w0) | (uint32_t) (uint16_t) (w1) << 16))
+
+static void hfilter_sse2(uint32_t *out, const uint32_t *in, const axis_t *a, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const int16_t *w;
+	const uint32_t *p;
+	__m128i acc, px;
+	int i, k;
+
+	for (i = 0, w = a->w; i < n; i++, w += a->taps) {
+		p = in + a->start[i];
+		acc = _mm_set1_epi32(1 << (PREC - 1));
+		for (k = 0; k + 1 < a->taps; k += 2) {
+			/* b0 b1 g0 g1 r0 r1 a0 a1 */
+			px = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (p + k)), zero);
+			px = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(WPAIR(w[k], w[k + 1]))));
+		}
+		if (k < a->taps) {
+			px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[k]), zero);
+			px = _mm_unpacklo_epi16(px, zero);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(WPAIR(w[k], 0))));
+		}
+		acc = _mm_srai_epi32(acc, PREC);
+		acc = _mm_packs_epi32(acc, acc);
+		out[i] = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+	}
+}
+
+static void vfilter_sse2(uint32_t *out, const uint32_t **rows, const int16_t *w,
+                         int taps, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc[4], a, b, alo, ahi, blo, bhi, wv;
+	int i, j, k;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		for (j = 0; j < 4; j++)
+			acc[j] = _mm_set1_epi32(1 << (PREC - 1));
+		for (k = 0; k < taps; k += 2) {
+			a = _mm_loadu_si128((const __m128i*) (rows[k] + i));
+			b = k + 1 < taps ? _mm_loadu_si128((const __m128i*) (rows[k + 1] + i)) : zero;
+			wv = _mm_set1_epi32(WPAIR(w[k], k + 1 < taps ? w[k + 1] : 0));
+			alo = _mm_unpacklo_epi8(a, zero);
+			ahi = _mm_unpackhi_epi8(a, zero);
+			blo = _mm_unpacklo_epi8(b, zero);
+			bhi = _mm_unpackhi_epi8(b, zero);
+			acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_unpacklo_epi16(alo, blo), wv));
+			acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_unpackhi_epi16(alo, blo), wv));
+			acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(_mm_unpacklo_epi16(ahi, bhi), wv));
+			acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(_mm_unpackhi_epi16(ahi, bhi), wv));
+		}
+		for (j = 0; j < 4; j++)
+			acc[j] = _mm_srai_epi32(acc[j], PREC);
+		a = _mm_packs_epi32(acc[0], acc[1]);
+		b = _mm_packs_epi32(acc[2], acc[3]);
+		_mm_storeu_si128((__m128i*) (out + i), _mm_packus_epi16(a, b));
+	}
+	VFILTER_TAIL(vfilter_c, out, rows, w, taps, n, i);
+}
+#endif /* RENDER_SSE2 */
+
+#if RENDER_AVX2
+__attribute__((target("avx2")))
+static void vfilter_avx2(uint32_t *out, const uint32_t **rows, const int16_t *w,
+                         int taps, int n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc[4], a, b, alo, ahi, blo, bhi, wv;
+	int i, j, k;
+
+	/* unpacking and packing both work within the 128 bit lanes, so acc[0]
+	 * holds the pixels 0 and 4, acc[1] 1 and 5 and so on, which are packed
+	 * back in order
+	 */
+	for (i = 0; i + 8 <= n; i += 8) {
+		for (j = 0; j < 4; j++)
+			acc[j] = _mm256_set1_epi32(1 << (PREC - 1));
+		for (k = 0; k < taps; k += 2) {
+			a = _mm256_loadu_si256((const __m256i*) (rows[k] + i));
+			b = k + 1 < taps ? _mm256_loadu_si256((const __m256i*) (rows[k + 1] + i)) : zero;
+			wv = _mm256_set1_epi32(WPAIR(w[k], k + 1 < taps ? w[k + 1] : 0));
+			alo = _mm256_unpacklo_epi8(a, zero);
+			ahi = _mm256_unpackhi_epi8(a, zero);
+			blo = _mm256_unpacklo_epi8(b, zero);
+			bhi = _mm256_unpackhi_epi8(b, zero);
+			acc[0] = _mm256_add_epi32(acc[0], _mm256_madd_epi16(_mm256_unpacklo_epi16(alo, blo), wv));
+			acc[1] = _mm256_add_epi32(acc[1], _mm256_madd_epi16(_mm256_unpackhi_epi16(alo, blo), wv));
+			acc[2] = _mm256_add_epi32(acc[2], _mm256_madd_epi16(_mm256_unpacklo_epi16(ahi, bhi), wv));
+			acc[3] = _mm256_add_epi32(acc[3], _mm256_madd_epi16(_mm256_unpackhi_epi16(ahi, bhi), wv));
+		}
+		for (j = 0; j < 4; j++)
+			acc[j] = _mm256_srai_epi32(acc[j], PREC);
+		a = _mm256_packs_epi32(acc[0], acc[1]);
+		b = _mm256_packs_epi32(acc[2], acc[3]);
+		_mm256_storeu_si256((__m256i*) (out + i), _mm256_packus_epi16(a, b));
+	}
+	VFILTER_TAIL(vfilter_sse2, out, rows, w, taps, n, i);
+}
+#endif /* RENDER_AVX2 */
+
+#if RENDER_NEON
+static void hfilter_neon(uint32_t *out, const uint32_t *in, const axis_t *a, int n)
+{
+	const int16_t *w;
+	const uint32_t *p;
+	int32x4_t acc;
+	int16x4_t px;
+	uint16x4_t r;
+	int i, k;
+
+	for (i = 0, w = a->w; i < n; i++, w += a->taps) {
+		p = in + a->start[i];
+		acc = vdupq_n_s32(1 << (PREC - 1));
+		for (k = 0; k < a->taps; k++) {
+			px = vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(p[k])))));
+			acc = vmlal_n_s16(acc, px, w[k]);
+		}
+		r = vqshrun_n_s32(acc, PREC);
+		out[i] = vget_lane_u32(vreinterpret_u32_u8(vqmovn_u16(vcombine_u16(r, r))), 0);
+	}
+}
+
+static void vfilter_neon(uint32_t *out, const uint32_t **rows, const int16_t *w,
+                         int taps, int n)
+{
+	int32x4_t acc[4];
+	int16x8_t lo, hi;
+	uint16x8_t r01, r23;
+	uint8x16_t px;
+	int i, j, k;
+
+	/* every half of a widened vector is one pixel */
+	for (i = 0; i + 4 <= n; i += 4) {
+		for (j = 0; j < 4; j++)
+			acc[j] = vdupq_n_s32(1 << (PREC - 1));
+		for (k = 0; k < taps; k++) {
+			px = vreinterpretq_u8_u32(vld1q_u32(rows[k] + i));
+			lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(px)));
+			hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(px)));
+			acc[0] = vmlal_n_s16(acc[0], vget_low_s16(lo), w[k]);
+			acc[1] = vmlal_n_s16(acc[1], vget_high_s16(lo), w[k]);
+			acc[2] = vmlal_n_s16(acc[2], vget_low_s16(hi), w[k]);
+			acc[3] = vmlal_n_s16(acc[3], vget_high_s16(hi), w[k]);
+		}
+		r01 = vcombine_u16(vqshrun_n_s32(acc[0], PREC), vqshrun_n_s32(acc[1], PREC));
+		r23 = vcombine_u16(vqshrun_n_s32(acc[2], PREC), vqshrun_n_s32(acc[3], PREC));
+		vst1q_u32(out + i, vreinterpretq_u32_u8(vcombine_u8(vqmovn_u16(r01), vqmovn_u16(r23))));
+	}
+	VFILTER_TAIL(vfilter_c, out, rows, w, taps, n, i);
+}
+#endif /* RENDER_NEON */
+
+/* p is a straight ARGB pixel of the source */
+static inline uint32_t render_blend(const render_dst_t *dst, uint32_t p,
+                                    bool alpha, int x, int y)
+{
+	uint32_t a, b, r, g, bl;
+
+	r = CH(p, 16);
+	g = CH(p, 8);
+	bl = CH(p, 0);
+	if (dst->lut != NULL) {
+		r = dst->lut[r];
+		g = dst->lut[g];
+		bl = dst->lut[bl];
+	}
+	a = alpha ? CH(p, 24) : 0xFF;
+	if (!dst->blend)
+		return a << 24 | r << 16 | g << 8 | bl;
+	if (a != 0xFF) {
+		b = dst->bg[((x - dst->bgx) >> 3 ^ (y - dst->bgy) >> 3) & 1];
+		r = DIV255(r * a + CH(b, 16) * (255 - a));
+		g = DIV255(g * a + CH(b, 8) * (255 - a));
+		bl = DIV255(bl * a + CH(b, 0) * (255 - a));
+	}
+	return 0xFF000000 | r << 16 | g << 8 | bl;
+}
+
+static void render_band(job_t *job, int n)
+{
+	render_dst_t *dst = job->dst;
+	const render_src_t *src = job->src;
+	int dw = job->x1 - job->x0, dh = job->y1 - job->y0, taps = job->v.taps;
+	int x, y, y0, y1, i, k, s, done = -1;
+	const uint32_t *rows[taps], *in;
+	uint32_t *ring, *out, *row, *line;
+
+	y0 = job->y0 + (int) ((long long) dh * n / job->bands);
+	y1 = job->y0 + (int) ((long long) dh * (n + 1) / job->bands);
+	ring = job->rows + (size_t) n * (taps + 1) * dw;
+	out = ring + (size_t) taps * dw;
+	line = job->lines + (size_t) n * job->lw;
+
+	for (y = y0; y < y1; y++) {
+		row = dst->data + (size_t) y * dst->stride;
+		s = job->v.start[y - job->y0];
+		if (dst->filter == FILTER_NEAREST) {
+			in = job->base + s * job->dv;
+			for (x = job->x0; x < job->x1; x++) {
+				row[x] = render_blend(dst, in[job->h.start[x - job->x0] * job->du],
+				                      src->alpha, x, y);
+			}
+			continue;
+		}
+		/* the first rows of a destination row are never before the ones of
+		 * the previous row, so source row i stays in ring slot i % taps
+		 * until it is not needed anymore
+		 */
+		for (i = MAX(done + 1, s); i < s + taps; i++) {
+			in = job->base + i * job->dv;
+			if (job->du != 1) {
+				for (k = job->h.start[0]; k < job->h.start[dw - 1] + job->h.taps; k++)
+					line[k] = in[k * job->du];
+				in = line;
+			}
+			hfilter(ring + (size_t) (i % taps) * dw, in, &job->h, dw);
+		}
+		done = MAX(done, s + taps - 1);
+		for (i = 0; i < taps; i++)
+			rows[i] = ring + (size_t) ((s + i) % taps) * dw;
+		vfilter(out, rows, job->v.w + (size_t) (y - job->y0) * taps, taps, dw);
+
+		for (x = 0; x < dw; x++)
+			row[job->x0 + x] = render_blend(dst, out[x], src->alpha, job->x0 + x, y);
+	}
+}
+
+static void* render_worker(void *arg)
+{
+	unsigned long gen = 0;
+	job_t *job;
+	int n;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.gen == gen)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		gen = pool.gen;
+		job = pool.job;
+		while (pool.next < job->bands) {
+			n = pool.next++;
+			pthread_mutex_unlock(&pool.lock);
+			render_band(job, n);
+			pthread_mutex_lock(&pool.lock);
+			if (++pool.finished == job->bands)
+				pthread_cond_signal(&pool.done);
+		}
+	}
+	return NULL;
+}
+
+/* chooses the kernels for the cpu and starts the threads */
+static void render_setup(void)
+{
+	pthread_t t;
+	long n;
+
+	hfilter = hfilter_c;
+	vfilter = vfilter_c;
+#if RENDER_SSE2
+	hfilter = hfilter_sse2;
+	vfilter = vfilter_sse2;
+#if RENDER_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		vfilter = vfilter_avx2;
+#endif
+#elif RENDER_NEON
+	hfilter = hfilter_neon;
+	vfilter = vfilter_neon;
+#endif
+
+	n = RENDER_THREADS > 0 ? RENDER_THREADS : sysconf(_SC_NPROCESSORS_ONLN);
+	n = MIN(MAX(n, 1), MAX_THREADS);
+	for (pool.cnt = 1; pool.cnt < n; pool.cnt++) {
+		if (pthread_create(&t, NULL, render_worker, NULL) != 0)
+			break;
+		pthread_detach(t);
+	}
+}
+
+/* returns the number of threads, which render bands, including this one */
+static int render_threads(void)
+{
+	pthread_once(&pool.once, render_setup);
+	return pool.cnt;
+}
+
+static void render_run(job_t *job)
+{
+	int n;
+
+	if (job->bands == 1) {
+		render_band(job, 0);
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.job = job;
+	pool.next = pool.finished = 0;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.work);
+	while (pool.next < job->bands) {
+		n = pool.next++;
+		pthread_mutex_unlock(&pool.lock);
+		render_band(job, n);
+		pthread_mutex_lock(&pool.lock);
+		pool.finished++;
+	}
+	while (pool.finished < job->bands)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+#define ALIGN16(n) (((n) + 15) & ~(size_t) 15)
+
+/* the addresses of the pixels of src, when it is oriented */
+static void render_orient(job_t *job, const render_src_t *src)
+{
+	int i, t, w, xu = 1, xv = 0, xc = 0, yu = 0, yv = 1, yc = 0;
+
+	/* the coordinates in the source as functions of u and v, after undoing
+	 * the rotation step by step and then the flip
+	 */
+	for (i = src->rot; i > 0; i--) {
+		/* x, y of the image rotated i times is y, w-1-x of the one rotated
+		 * i-1 times, w being the width of the former
+		 */
+		w = i & 1 ? src->h : src->w;
+		t = xu;
+		xu = yu;
+		yu = -t;
+		t = xv;
+		xv = yv;
+		yv = -t;
+		t = xc;
+		xc = yc;
+		yc = w - 1 - t;
+	}
+	if (src->flip) {
+		xu = -xu;
+		xv = -xv;
+		xc = src->w - 1 - xc;
+	}
+	job->base = src->data + (ptrdiff_t) yc * src->w + xc;
+	job->du = (ptrdiff_t) yu * src->w + xu;
+	job->dv = (ptrdiff_t) yv * src->w + xv;
+}
+
+void render_image(render_dst_t *dst, const render_src_t *src)
+{
+	filter_t f = dst->filter;
+	size_t rows = 0, lines = 0, hw = 0, vw = 0, size;
+	int dw, dh, lh, threads;
+	bool shared;
+	char *p;
+	job_t job;
+
+	render_bounds(src, &job.x0, &job.y0, &job.x1, &job.y1);
+	job.x0 = MAX(job.x0, dst->x);
+	job.y0 = MAX(job.y0, dst->y);
+	job.x1 = MIN(job.x1, dst->x + dst->w);
+	job.y1 = MIN(job.y1, dst->y + dst->h);
+	if (job.x0 >= job.x1 || job.y0 >= job.y1 || src->data == NULL)
+		return;
+	dw = job.x1 - job.x0;
+	dh = job.y1 - job.y0;
+
+	job.dst = dst;
+	job.src = src;
+	job.lw = src->rot & 1 ? src->h : src->w;
+	lh = src->rot & 1 ? src->w : src->h;
+	render_orient(&job, src);
+	job.h.taps = axis_taps(f, src->zx, job.lw);
+	job.v.taps = axis_taps(f, src->zy, lh);
+	threads = render_threads();
+	if ((shared = pthread_mutex_trylock(&pool.use) == 0))
+		job.bands = MIN(threads, MAX((long long) dw * dh / MIN_BAND, 1));
+	else
+		job.bands = 1;
+	job.bands = MIN(job.bands, dh);
+
+	if (f != FILTER_NEAREST) {
+		rows = (size_t) job.bands * (job.v.taps + 1) * dw;
+		lines = job.du != 1 ? (size_t) job.bands * job.lw : 0;
+		hw = (size_t) dw * job.h.taps;
+		vw = (size_t) dh * job.v.taps;
+	}
+	size = ALIGN16((rows + lines) * sizeof(uint32_t)) +
+	       ALIGN16(((size_t) dw + dh) * sizeof(int)) + (hw + vw) * sizeof(int16_t);
+	if (!shared) {
+		p = emalloc(size);
+	} else {
+		if (size > scratch.size) {
+			free(scratch.data);
+			scratch.data = emalloc(size);
+			scratch.size = size;
+		}
+		p = scratch.data;
+	}
+	job.rows = (uint32_t*) p;
+	job.lines = job.rows + rows;
+	p += ALIGN16((rows + lines) * sizeof(uint32_t));
+	job.h.start = (int*) p;
+	job.v.start = job.h.start + dw;
+	p += ALIGN16(((size_t) dw + dh) * sizeof(int));
+	job.h.w = (int16_t*) p;
+	job.v.w = job.h.w + hw;
+
+	axis_init(&job.h, f, job.x0, dw, src->x, src->zx, job.lw);
+	axis_init(&job.v, f, job.y0, dh, src->y, src->zy, lh);
+
+	render_run(&job);
+
+	if (shared)
+		pthread_mutex_unlock(&pool.use);
+	else
+		free(job.rows);
+}
+
+void render_fill(render_dst_t *dst, int x, int y, int w, int h, uint32_t col)
+{
+	int x0, y0, x1, y1, i;
+	uint32_t *row;
+
+	x0 = MAX(x, dst->x);
+	y0 = MAX(y, dst->y);
+	x1 = MIN(x + w, dst->x + dst->w);
+	y1 = MIN(y + h, dst->y + dst->h);
+
+	for (; y0 < y1; y0++) {
+		row = dst->data + (size_t) y0 * dst->stride;
+		for (i = x0; i < x1; i++)
+			row[i] = col;
+	}
+}
+
+/* copies the straight ARGB pixels p of the area x, y, w, h, which has stride
+ * pixels per row, gamma corrected and blended like the rendered ones; alpha
+ * is set, if p may contain transparent pixels
+ */
+void render_copy(render_dst_t *dst, const uint32_t *p, int stride, bool alpha,
+                 int x, int y, int w, int h)
+{
+	uint32_t *row;
+	int i, j;
+
+	for (j = 0; j < h; j++, p += stride) {
+		row = dst->data + (size_t) (y + j) * dst->stride + x;
+		if (dst->lut == NULL && (!alpha || !dst->blend)) {
+			memcpy(row, p, w * sizeof(uint32_t));
+			continue;
+		}
+		for (i = 0; i < w; i++)
+			row[i] = render_blend(dst, p[i], alpha, x + i, y + j);
+	}
+}
+
+/* moves the pixels of the area by dx, dy, the uncovered pixels are kept */
+void render_move(render_dst_t *dst, int dx, int dy)
+{
+	int y, y0, y1, dy1, x, w;
+
+	x = dst->x + MAX(dx, 0);
+	w = dst->w - abs(dx);
+	if (w <= 0 || abs(dy) >= dst->h)
+		return;
+
+	/* rows are moved in the order, which does not overwrite the ones, which
+	 * still have to be moved
+	 */
+	y0 = dst->y + MAX(dy, 0);
+	y1 = dst->y + dst->h + MIN(dy, 0);
+	dy1 = dy > 0 ? -1 : 1;
+	for (y = dy > 0 ? y1 - 1 : y0; y >= y0 && y < y1; y += dy1) {
+		memmove(dst->data + (size_t) y * dst->stride + x,
+		        dst->data + (size_t) (y - dy) * dst->stride + x - dx,
+		        w * sizeof(uint32_t));
+	}
+}
@@ -64,6 +64,18 @@
   (tv)->tv_usec += (t) % 1000 * 1000;   \
 }
 
+#define TS_DIFF(t1,t2) (((t1)->tv_sec  - (t2)->tv_sec ) * 1000 + \
+                        ((t1)->tv_nsec - (t2)->tv_nsec) / 1000000)
+
+#define TS_BEFORE(t1,t2) ((t1)->tv_sec < (t2)->tv_sec || \
+                          ((t1)->tv_sec == (t2)->tv_sec && (t1)->tv_nsec < (t2)->tv_nsec))
+
+#define TS_ADD_MSEC(ts,t) {                                     \
+  (ts)->tv_nsec += (t) % 1000 * 1000000;                        \
+  (ts)->tv_sec  += (t) / 1000 + (ts)->tv_nsec / 1000000000;     \
+  (ts)->tv_nsec %= 1000000000;                                  \
+}
+
 typedef enum {
 	MODE_IMAGE,
 	MODE_THUMB
@@ -117,15 +129,42 @@ typedef enum {
 	FF_TN_INIT = 4
 } fileflags_t;
 
+typedef enum {
+	FMT_UNKNOWN,
+	FMT_JPEG,
+	FMT_PNG,
+	FMT_GIF,
+	FMT_FARBFELD,
+	FMT_PNM
+} fileformat_t;
+
+/* result of img_probe(), valid as long as the mtime and size of the file are
+ * unchanged; w and h are 0, orientation is 0 and preview (the offset of the
+ * embedded exif thumbnail) is 0, if they are unknown
+ */
+typedef struct {
+	bool valid;
+	time_t mtime;
+	off_t size;
+	fileformat_t format;
+	int w;
+	int h;
+	int orientation;
+	off_t preview;
+	size_t preview_len;
+} filemeta_t;
+
 typedef struct {
 	const char *name; /* as given by user */
 	const char *path; /* always absolute */
 	fileflags_t flags;
+	filemeta_t meta;
 } fileinfo_t;
 
 /* timeouts in milliseconds: */
 enum {
-	TO_DOUBLE_CLICK  = 300
+	TO_DOUBLE_CLICK  = 300,
+	TO_REFINE        = 150
 };
 
 typedef void (*timeout_f)(void);
@@ -196,13 +235,107 @@ typedef struct {
 extern const cmd_t cmds[CMD_COUNT];
 
 
+/* render.c */
+
+typedef enum {
+	FILTER_NEAREST,
+	FILTER_BOX,
+	FILTER_BILINEAR,
+	FILTER_LANCZOS
+} filter_t;
+
+/* destination pixels, x, y, w, h is the area, which may be drawn */
+typedef struct {
+	uint32_t *data;
+	int stride;
+	int x;
+	int y;
+	int w;
+	int h;
+
+	/* colors of the checkerboard behind transparent pixels, which starts at
+	 * bgx, bgy; lut is the gamma correction table of the red, green and blue
+	 * channels, if not NULL
+	 */
+	uint32_t bg[2];
+	int bgx;
+	int bgy;
+	const DATA8 *lut;
+	filter_t filter;
+
+	/* transparent pixels are blended onto the checkerboard, otherwise the
+	 * alpha channel is kept
+	 */
+	bool blend;
+} render_dst_t;
+
+/* straight ARGB pixels of size w x h, which are flipped horizontally, if flip
+ * is set, rotated clockwise by rot * 90 degrees and drawn at x, y scaled by
+ * zx, zy
+ */
+typedef struct {
+	const DATA32 *data;
+	int w;
+	int h;
+	bool alpha;
+	bool flip;
+	int rot;
+	float x;
+	float y;
+	float zx;
+	float zy;
+} render_src_t;
+
+void render_bounds(const render_src_t*, int*, int*, int*, int*);
+void render_image(render_dst_t*, const render_src_t*);
+void render_fill(render_dst_t*, int, int, int, int, uint32_t);
+void render_move(render_dst_t*, int, int);
+void render_copy(render_dst_t*, const uint32_t*, int, bool, int, int, int, int);
+
+
 /* image.c */
 
 typedef struct {
 	Imlib_Image im;
 	unsigned int delay;
+
+	/* gif: offset of the image record and its graphic control values, key is
+	 * a snapshot of the canvas before the frame is drawn; pix are the palette
+	 * indices of the area x, y, w, h, which the frame changes, in case they
+	 * are stored
+	 */
+	size_t pos;
+	int transp;
+	int disposal;
+	DATA32 *key;
+	unsigned char *pix;
+	DATA32 *lut;
+	int x;
+	int y;
+	int w;
+	int h;
 } img_frame_t;
 
+/* state of a lazily decoded gif: the frames are drawn one after another onto
+ * the canvas, which is ready for frame next
+ */
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t pos;
+	void *dec;
+	DATA32 *canvas;
+	DATA32 bg;
+	unsigned char *pix;
+	size_t pixcap;
+	DATA32 lut[256];
+	int next;
+	int w;
+	int h;
+	int keyint;
+	size_t size;
+} img_gif_t;
+
 typedef struct {
 	img_frame_t *frames;
 	int cap;
@@ -211,13 +344,51 @@ typedef struct {
 	bool animate;
 	int framedelay;
 	int length;
+	img_gif_t *gif;
 } multi_img_t;
 
+typedef struct {
+	char *path;
+	time_t mtime;
+	Imlib_Image im;
+	int w;
+	int h;
+	multi_img_t multi;
+	size_t size;
+	unsigned long used;
+} img_slot_t;
+
+typedef struct {
+	Imlib_Image im;
+	unsigned long used;
+} img_tile_t;
+
+typedef struct {
+	int w;
+	int h;
+	int cols;
+	int rows;
+	img_tile_t *tiles;
+} img_level_t;
+
 struct img {
 	Imlib_Image im;
 	int w;
 	int h;
 
+	char *path;
+	time_t mtime;
+	filemeta_t meta;
+
+	/* rotation (in steps of 90 degrees clockwise) and horizontal flip done by
+	 * the user, flip first; they are applied after the exif orientation, when
+	 * the image is rendered, the pixel data is never rotated
+	 */
+	struct {
+		int rot;
+		bool flip;
+	} orient;
+
 	win_t *win;
 	float x;
 	float y;
@@ -230,21 +401,96 @@ struct img {
 	bool aa;
 	bool alpha;
 
-	Imlib_Color_Modifier cmod;
+	/* input is arriving, the image is rendered with INTERACTIVE_FILTER until
+	 * img_refine() is called
+	 */
+	bool quick;
+
+	/* the part of the image, which changed since it was rendered, in case
+	 * only that needs to be rendered again (w == 0 if nothing changed)
+	 */
+	struct {
+		int x, y, w, h;
+	} area;
+
+	/* whole pixels, by which the image was moved since it was rendered */
+	struct {
+		int x, y;
+	} shift;
+
 	int gamma;
 
+	/* gamma correction tables of the steps, which were used, 256 entries
+	 * per step from -GAMMA_RANGE on (done[i] if step i is filled in)
+	 */
+	struct {
+		DATA8 *tab;
+		bool *done;
+	} lut;
+
 	struct {
 		bool on;
 		int delay;
 	} ss;
 
 	multi_img_t multi;
+
+	struct {
+		img_slot_t *slots;
+		int cap;
+		int cnt;
+		size_t size;
+		unsigned long tick;
+	} cache;
+
+	struct {
+		int sel;
+		int cnt;
+		int done;
+		int pending; /* images being read by the threads */
+		int fd;      /* readable, when they are done */
+	} pf;
+
+	/* level i of the pyramid is downscaled by 2^i, level base is img->im,
+	 * finer levels are decoded from the file, coarser ones scaled from im
+	 */
+	struct {
+		img_level_t *levels;
+		int cnt;
+		int base;
+		size_t size;
+		unsigned long tick;
+	} pyr;
+
+	/* the window buffer, into which the image is rendered */
+	render_dst_t dst;
+
+	/* the image scaled and blended onto its background for an area around
+	 * the window, from which the window is drawn; x, y, w, h is relative to
+	 * the position of the image rounded down. It is valid for the image,
+	 * zoom level, fraction of the position, orientation and filter it was
+	 * rendered with. The pixels are not gamma corrected nor blended onto the
+	 * checkerboard, which is done when they are copied into the window
+	 */
+	struct {
+		DATA32 *data;
+		size_t cap;
+		int x, y, w, h;
+		Imlib_Image im;
+		float zoom;
+		float fx, fy;
+		int rot;
+		bool flip;
+		filter_t filter;
+	} view;
 };
 
 void img_init(img_t*, win_t*);
-bool img_load(img_t*, const fileinfo_t*);
+bool img_probe(fileinfo_t*);
+bool img_load(img_t*, fileinfo_t*);
 CLEANUP void img_close(img_t*, bool);
 void img_render(img_t*);
+bool img_refine(img_t*);
 bool img_fit_win(img_t*, scalemode_t);
 bool img_zoom(img_t*, float);
 bool img_zoom_in(img_t*);
@@ -258,7 +504,10 @@ void img_flip(img_t*, flipdir_t);
 void img_toggle_antialias(img_t*);
 bool img_change_gamma(img_t*, int);
 bool img_frame_navigate(img_t*, int);
-bool img_frame_animate(img_t*);
+bool img_frame_animate(img_t*, int);
+bool img_prefetch(img_t*, fileinfo_t*, int, int);
+void img_collect(img_t*);
+CLEANUP void img_free(img_t*);
 
 
 
@@ -312,14 +561,24 @@ void print_version(void);
 void parse_options(int, char**);
 
 
+/* cache.c */
+
+bool cache_open(const char*);
+const void* cache_find(const char*, off_t, time_t, size_t*, bool*);
+void cache_add(const char*, off_t, time_t, const void*, size_t);
+void cache_compact(bool);
+
+
 /* thumbs.c */
 
 typedef struct {
-	Imlib_Image im;
+	Imlib_Image im;      /* of the current zoom level */
+	Imlib_Image *levels; /* of the zoom levels up to the one above the current */
 	int w;
 	int h;
 	int x;
 	int y;
+	unsigned long job; /* id of the job loading it, 0 if none */
 } thumb_t;
 
 struct tns {
@@ -327,10 +586,18 @@ struct tns {
 	thumb_t *thumbs;
 	const int *cnt;
 	int *sel;
+
+	/* the next files to be loaded, visible ones first, then all the others
+	 * to be cached; loaded jobs are announced through the eventfd fd
+	 */
 	int initnext;
 	int loadnext;
+	int fd;
+
 	int first, end;
 	int r_first, r_end;
+	int a_first, a_end; /* the rows ahead in scroll direction dir */
+	int dir;
 
 	win_t *win;
 	int x;
@@ -348,6 +615,8 @@ void tns_clean_cache(tns_t*);
 void tns_init(tns_t*, fileinfo_t*, const int*, int*, win_t*);
 CLEANUP void tns_free(tns_t*);
 bool tns_load(tns_t*, int, bool, bool);
+bool tns_schedule(tns_t*);
+bool tns_collect(tns_t*);
 void tns_unload(tns_t*, int);
 void tns_render(tns_t*);
 void tns_mark(tns_t*, int, bool);
@@ -389,9 +658,24 @@ int r_mkdir(char*);
 /* window.c */
 enum {
 	BAR_L_LEN = 512,
-	BAR_R_LEN = 64
+	BAR_R_LEN = 64,
+
+	/* drawing continues in another buffer, while the compositor reads one */
+	WIN_BUFFERS = 3,
+
+	/* damaged rectangles are merged into one, when there are more */
+	WIN_RECTS = 8
 };
 
+typedef struct {
+	int x, y, w, h;
+} win_rect_t;
+
+typedef struct {
+	win_rect_t rects[WIN_RECTS];
+	int cnt;
+} win_region_t;
+
 typedef struct {
 	size_t size;
 	char *p;
@@ -402,9 +686,12 @@ typedef struct {
 	int fd;
 	uint8_t *data;
 	size_t data_size;
+	int width, height;
 	cairo_t *cr;
 	PangoLayout *layout;
 	struct wl_buffer *wl_buf;
+	bool busy; /* committed and not yet released by the compositor */
+	win_region_t stale; /* changed in the committed buffer since */
 } win_buf_t;
 
 struct win {
@@ -453,7 +740,9 @@ struct win {
 	color_t fg;
 
 	PangoFontDescription *font_desc;
-	win_buf_t buffer;
+	win_buf_t buffers[WIN_BUFFERS];
+	win_buf_t *buffer;
+	win_region_t damage; /* drawn into the buffer since the last commit */
 	int width, height;
 
 	bool quit;
@@ -471,10 +760,14 @@ void win_clear(win_t*);
 void win_draw(win_t*);
 void win_set_cursor(win_t*, cursor_t);
 void win_cursor_pos(win_t*, int*, int*);
+uint32_t* win_get_data(win_t*, int*, bool);
+void win_put_back_data(win_t*);
 void win_render_imlib_image(win_t *win, int x, int y);
-void win_render_imlib_image_at_size(win_t *win, int x, int y, int w, int h);
+void win_render_imlib_image_at_size(win_t *win, int x, int y, int w, int h, filter_t);
 void win_draw_rect(win_t *win, int x, int y, int w, int h, bool fill, int lw, color_t col);
 void win_recreate_buffer(win_t *win);
+void win_damage(win_t*, int, int, int, int);
+void win_commit(win_t*);
 
 
 /* main.c */
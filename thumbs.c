@@ -21,20 +21,103 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <utime.h>
 
+#if HAVE_LZ4
+#include <lz4.h>
+#endif
+
+void exif_orientation(const fileinfo_t*, bool*, int*);
 #if HAVE_LIBEXIF
-#include <libexif/exif-data.h>
-void exif_auto_orientate(const fileinfo_t*);
+Imlib_Image img_open_preview(fileinfo_t*);
+#if HAVE_LIBJPEG
+DATA32* img_read_preview(fileinfo_t*, int*, int*);
+#endif
 #endif
-Imlib_Image img_open(const fileinfo_t*);
+Imlib_Image img_open(fileinfo_t*, int, int, int*, int*);
+DATA32* img_read(fileinfo_t*, int, int, int*, int*, bool*);
+Imlib_Image img_from_data(DATA32*, int, int, bool);
+
+void remove_file(int, bool);
+
+static void tns_cancel(void);
+static void tns_requeue(tns_t*);
+static void tns_draw(tns_t*, int);
 
 static char *cache_dir;
+static char *pack_dir;
+static bool packed;
+
+enum {
+	MAX_THREADS = 32,
+	LEVELS      = ARRLEN(thumb_sizes)
+};
+
+/* thumbnails are read and scaled down to the cache size by a pool of threads,
+ * which must not use imlib: they write the thumbnails to the cache and hand
+ * the pixels back to the main thread, which makes them the thumbnail. Files,
+ * which can only be opened with imlib, are loaded by the main thread instead,
+ * one by every call of tns_schedule(). The threads also
+ * read the images, which are prefetched in image mode, before all thumbnails.
+ * The queue is ordered by priority, which follows the position of the file
+ * relative to the visible thumbnails
+ */
+typedef enum {
+	PRIO_IMAGE,
+	PRIO_VISIBLE,
+	PRIO_AHEAD,
+	PRIO_CACHE
+} jobprio_t;
+
+typedef struct tns_job {
+	struct tns_job *next;
+	unsigned long id;
+	jobprio_t prio;
+	int n;            /* index of the file, when the job was queued */
+	fileinfo_t file;  /* copy of the file, path is owned by the job */
+	int bw;           /* PRIO_IMAGE jobs: the box, the image is read for */
+	int bh;
+
+	/* the result, data is NULL, if the file is left to the main thread;
+	 * it is scaled down to the zoom levels up to top, unless it is -1
+	 */
+	DATA32 *data;
+	int w;
+	int h;
+	bool alpha;
+	int top;
+	DATA32 *levels[LEVELS];
+	int lw[LEVELS];
+	int lh[LEVELS];
+} tns_job_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	int cnt;
+	bool failed;
+	int fd;
+	unsigned long id;
+	int pending;      /* queued, running and done jobs, only used by main */
+	tns_job_t *todo;
+	tns_job_t *done;
+	tns_job_t *thumbs; /* the done jobs, which are not yet taken by main */
+	tns_job_t *images;
+	tns_job_t *imlib;  /* the jobs left to the main thread */
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.fd = -1
+};
 
 char* tns_cache_filepath(const char *filepath)
 {
@@ -53,41 +136,190 @@ char* tns_cache_filepath(const char *filepath)
 	return cfile;
 }
 
-Imlib_Image tns_cache_load(const char *filepath, bool *outdated)
+/* cached thumbnails, in the tree and in the packed cache: the header is followed
+ * by the straight ARGB pixels, which are compressed with lz4, if TNS_LZ4 is
+ * set. Thumbnails of another version are loaded again, the tree of every
+ * version is in its own directory
+ */
+enum {
+	TNS_VERSION = 1,
+	TNS_ALPHA   = 1 << 0,
+	TNS_LZ4     = 1 << 1,
+	TNS_MAX_LEN = 1 << 24
+};
+
+typedef struct {
+	char magic[4];
+	uint16_t version;
+	uint16_t flags;
+	uint32_t w;
+	uint32_t h;
+	uint32_t len;      /* of the pixels, as they are stored */
+	uint32_t pad[3];
+} tns_entry_t;
+
+static const char tns_magic[4] = "swtn";
+
+static void* tns_encode(const DATA32 *data, int w, int h, bool alpha, size_t *len)
+{
+	size_t size = (size_t) w * h * sizeof(DATA32);
+	tns_entry_t *e;
+	int n = 0;
+
+#if HAVE_LZ4
+	e = (tns_entry_t*) emalloc(sizeof(*e) + LZ4_compressBound(size));
+	n = LZ4_compress_default((const char*) data, (char*) (e + 1), size,
+	                         LZ4_compressBound(size));
+#else
+	e = (tns_entry_t*) emalloc(sizeof(*e) + size);
+#endif
+	memset(e, 0, sizeof(*e));
+	memcpy(e->magic, tns_magic, sizeof(tns_magic));
+	e->version = TNS_VERSION;
+	e->flags = alpha ? TNS_ALPHA : 0;
+	e->w = w;
+	e->h = h;
+	if (n > 0 && (size_t) n < size) {
+		e->flags |= TNS_LZ4;
+		e->len = n;
+	} else {
+		memcpy(e + 1, data, size);
+		e->len = size;
+	}
+	*len = sizeof(*e) + e->len;
+	return e;
+}
+
+/* the pixels of the cached thumbnail in buf, NULL if it is of another version
+ * or smaller than the cache size
+ */
+static DATA32* tns_decode(const void *buf, size_t len, int *w, int *h, bool *alpha)
+{
+	int maxwh = thumb_sizes[ARRLEN(thumb_sizes)-1];
+	const tns_entry_t *e = buf;
+	size_t size;
+	DATA32 *data;
+
+	if (len < sizeof(*e) || memcmp(e->magic, tns_magic, sizeof(tns_magic)) != 0 ||
+	    e->version != TNS_VERSION || len - sizeof(*e) != e->len ||
+	    e->w == 0 || e->h == 0 || e->w > (uint32_t) maxwh || e->h > (uint32_t) maxwh ||
+	    ((int) e->w < maxwh && (int) e->h < maxwh))
+	{
+		return NULL;
+	}
+	size = (size_t) e->w * e->h * sizeof(DATA32);
+	data = (DATA32*) emalloc(size);
+
+	if (e->flags & TNS_LZ4) {
+#if HAVE_LZ4
+		if (LZ4_decompress_safe((const char*) (e + 1), (char*) data, e->len,
+		                        size) != (int) size)
+#endif
+		{
+			free(data);
+			return NULL;
+		}
+	} else if (e->len == size) {
+		memcpy(data, e + 1, size);
+	} else {
+		free(data);
+		return NULL;
+	}
+	*w = e->w;
+	*h = e->h;
+	*alpha = (e->flags & TNS_ALPHA) != 0;
+	return data;
+}
+
+static void* tns_read_file(const char *path, const struct stat *fstats,
+                           size_t *len, bool *outdated)
+{
+	int fd;
+	ssize_t n;
+	struct stat cstats;
+	char *buf = NULL;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (fstat(fd, &cstats) == 0) {
+		if (cstats.st_mtime != fstats->st_mtime) {
+			*outdated = true;
+		} else if (cstats.st_size > 0 && cstats.st_size <= TNS_MAX_LEN) {
+			buf = emalloc(cstats.st_size);
+			for (*len = 0; *len < (size_t) cstats.st_size; *len += n) {
+				if ((n = read(fd, buf + *len, cstats.st_size - *len)) <= 0) {
+					free(buf);
+					buf = NULL;
+					break;
+				}
+			}
+		}
+	}
+	close(fd);
+	return buf;
+}
+
+/* reads the cached thumbnail of the file at filepath, it is safe to be used by
+ * the threads; outdated is set, if it is older than the file
+ */
+static DATA32* tns_cache_read(const char *filepath, int *w, int *h, bool *alpha,
+                              bool *outdated)
 {
 	char *cfile;
-	struct stat cstats, fstats;
-	Imlib_Image im = NULL;
+	void *buf;
+	const void *p;
+	size_t len;
+	struct stat fstats;
+	DATA32 *data = NULL;
 
-	if (stat(filepath, &fstats) < 0)
+	if (*filepath != '/' || stat(filepath, &fstats) < 0)
 		return NULL;
 
-	if ((cfile = tns_cache_filepath(filepath)) != NULL) {
-		if (stat(cfile, &cstats) == 0) {
-			if (cstats.st_mtime == fstats.st_mtime)
-				im = imlib_load_image(cfile);
-			else
-				*outdated = true;
+	if (packed) {
+		if ((p = cache_find(filepath, fstats.st_size, fstats.st_mtime, &len,
+		                    outdated)) != NULL)
+		{
+			data = tns_decode(p, len, w, h, alpha);
+		}
+	} else if ((cfile = tns_cache_filepath(filepath)) != NULL) {
+		if ((buf = tns_read_file(cfile, &fstats, &len, outdated)) != NULL) {
+			data = tns_decode(buf, len, w, h, alpha);
+			free(buf);
 		}
 		free(cfile);
 	}
-	return im;
+	return data;
 }
 
-void tns_cache_write(Imlib_Image im, const char *filepath, bool force)
+/* caches the thumbnail of the file at filepath, if force is true or it is not
+ * cached yet, it is safe to be used by the threads
+ */
+static void tns_cache_store(const char *filepath, const DATA32 *data, int w,
+                            int h, bool alpha, bool force)
 {
+	int fd;
 	char *cfile, *dirend;
+	void *buf;
+	size_t len;
 	struct stat cstats, fstats;
 	struct utimbuf times;
-	Imlib_Load_Error err;
+	bool outdated, ok;
 
 	if (options->private_mode)
 		return;
 
-	if (stat(filepath, &fstats) < 0)
+	if (*filepath != '/' || stat(filepath, &fstats) < 0)
 		return;
 
-	if ((cfile = tns_cache_filepath(filepath)) != NULL) {
+	if (packed) {
+		if (force || cache_find(filepath, fstats.st_size, fstats.st_mtime, &len,
+		                        &outdated) == NULL)
+		{
+			buf = tns_encode(data, w, h, alpha, &len);
+			cache_add(filepath, fstats.st_size, fstats.st_mtime, buf, len);
+			free(buf);
+		}
+	} else if ((cfile = tns_cache_filepath(filepath)) != NULL) {
 		if (force || stat(cfile, &cstats) < 0 ||
 		    cstats.st_mtime != fstats.st_mtime)
 		{
@@ -99,16 +331,15 @@ void tns_cache_write(Imlib_Image im, const char *filepath, bool force)
 				}
 				*dirend = '/';
 			}
-			imlib_context_set_image(im);
-			if (imlib_image_has_alpha()) {
-				imlib_image_set_format("png");
-			} else {
-				imlib_image_set_format("jpg");
-				imlib_image_attach_data_value("quality", NULL, 90, NULL);
-			}
-			imlib_save_image_with_error_return(cfile, &err);
-			if (err)
+			if ((fd = open(cfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+				goto end;
+			buf = tns_encode(data, w, h, alpha, &len);
+			ok = write(fd, buf, len) == (ssize_t) len;
+			free(buf);
+			if (close(fd) < 0 || !ok) {
+				unlink(cfile);
 				goto end;
+			}
 			times.actime = fstats.st_atime;
 			times.modtime = fstats.st_mtime;
 			utime(cfile, &times);
@@ -118,14 +349,41 @@ end:
 	}
 }
 
+Imlib_Image tns_cache_load(const char *filepath, bool *outdated)
+{
+	int w, h;
+	bool alpha;
+	DATA32 *data;
+	Imlib_Image im = NULL;
+
+	if ((data = tns_cache_read(filepath, &w, &h, &alpha, outdated)) != NULL &&
+	    (im = img_from_data(data, w, h, alpha)) == NULL)
+	{
+		free(data);
+	}
+	return im;
+}
+
+void tns_cache_write(Imlib_Image im, const char *filepath, bool force)
+{
+	imlib_context_set_image(im);
+	tns_cache_store(filepath, imlib_image_get_data_for_reading_only(),
+	                imlib_image_get_width(), imlib_image_get_height(),
+	                imlib_image_has_alpha(), force);
+}
+
 void tns_clean_cache(tns_t *tns)
 {
 	int dirlen;
 	char *cfile, *filename;
 	r_dir_t dir;
 
+	if (packed)
+		cache_compact(true);
+
 	if (r_opendir(&dir, cache_dir, true) < 0) {
-		error(0, errno, "%s", cache_dir);
+		if (!packed || errno != ENOENT)
+			error(0, errno, "%s", cache_dir);
 		return;
 	}
 
@@ -158,7 +416,10 @@ void tns_init(tns_t *tns, fileinfo_t *files, const int *cnt, int *sel,
 	tns->files = files;
 	tns->cnt = cnt;
 	tns->initnext = tns->loadnext = 0;
+	tns->fd = -1;
 	tns->first = tns->end = tns->r_first = tns->r_end = 0;
+	tns->a_first = tns->a_end = 0;
+	tns->dir = 1;
 	tns->sel = sel;
 	tns->win = win;
 	tns->dirty = false;
@@ -172,11 +433,18 @@ void tns_init(tns_t *tns, fileinfo_t *files, const int *cnt, int *sel,
 	}
 	if (homedir != NULL) {
 		free(cache_dir);
-		len = strlen(homedir) + strlen(dsuffix) + 6;
+		free(pack_dir);
+		len = strlen(homedir) + strlen(dsuffix) + 32;
 		cache_dir = (char*) emalloc(len);
-
-		/* use sxiv's cache dir since it shouldn't be handled any different */
-		snprintf(cache_dir, len, "%s%s/sxiv", homedir, dsuffix);
+		pack_dir = (char*) emalloc(len);
+
+		/* not sxiv's cache dir, because sxiv can not read the thumbnails */
+		snprintf(pack_dir, len, "%s%s/swiv", homedir, dsuffix);
+		snprintf(cache_dir, len, "%s/thumbs-%d", pack_dir, TNS_VERSION);
+		/* nothing is written in private mode, not even an empty cache */
+		packed = THUMB_CACHE_PACKED;
+		if (packed && !options->private_mode)
+			packed = cache_open(pack_dir);
 	} else {
 		error(0, 0, "Cache directory not found");
 	}
@@ -186,50 +454,170 @@ CLEANUP void tns_free(tns_t *tns)
 {
 	int i;
 
+	tns_cancel();
+
 	if (tns->thumbs != NULL) {
-		for (i = 0; i < *tns->cnt; i++) {
-			if (tns->thumbs[i].im != NULL) {
-				imlib_context_set_image(tns->thumbs[i].im);
-				imlib_free_image();
-			}
-		}
+		for (i = 0; i < *tns->cnt; i++)
+			tns_unload(tns, i);
 		free(tns->thumbs);
 		tns->thumbs = NULL;
 	}
-
-	free(cache_dir);
-	cache_dir = NULL;
+	/* cache_dir and pack_dir are not freed, because the running jobs might
+	 * still write their thumbnails to the cache, until the process exits
+	 */
 }
 
-Imlib_Image tns_scale_down(Imlib_Image im, int dim)
+/* renders the pixels of size w x h flipped, rotated and scaled down to fit
+ * into dim x dim into new pixels of size dw x dh; returns NULL, if they need
+ * not be changed
+ */
+static DATA32* tns_scale(const DATA32 *data, int w, int h, bool alpha, int dim,
+                         bool flip, int rot, int *dw, int *dh)
 {
-	int w, h;
+	int ow, oh;
 	float z, zw, zh;
+	render_src_t src;
+	render_dst_t dst;
 
-	imlib_context_set_image(im);
-	w = imlib_image_get_width();
-	h = imlib_image_get_height();
-	zw = (float) dim / (float) w;
-	zh = (float) dim / (float) h;
+	ow = rot & 1 ? h : w;
+	oh = rot & 1 ? w : h;
+	zw = (float) dim / (float) ow;
+	zh = (float) dim / (float) oh;
 	z = MIN(zw, zh);
 	z = MIN(z, 1.0);
 
-	if (z < 1.0) {
-		imlib_context_set_anti_alias(1);
-		im = imlib_create_cropped_scaled_image(0, 0, w, h,
-		                                       MAX(z * w, 1), MAX(z * h, 1));
-		if (im == NULL)
-			error(EXIT_FAILURE, ENOMEM, NULL);
+	if (z >= 1.0 && !flip && rot == 0)
+		return NULL;
+
+	src.data = data;
+	src.w = w;
+	src.h = h;
+	src.alpha = alpha;
+	src.flip = flip;
+	src.rot = rot;
+	src.x = src.y = 0.0;
+	src.zx = (float) MAX(z * ow, 1) / ow;
+	src.zy = (float) MAX(z * oh, 1) / oh;
+
+	dst.w = *dw = MAX(z * ow, 1);
+	dst.h = *dh = MAX(z * oh, 1);
+	dst.data = emalloc((size_t) dst.w * dst.h * sizeof(DATA32));
+	dst.stride = dst.w;
+	dst.x = dst.y = 0;
+	dst.bgx = dst.bgy = 0;
+	dst.lut = NULL;
+	dst.filter = z < 1.0 ? THUMB_FILTER : FILTER_NEAREST;
+	dst.blend = false;
+	render_image(&dst, &src);
+
+	return dst.data;
+}
+
+/* scales im down to fit into dim x dim, after it is flipped and rotated */
+Imlib_Image tns_scale_down(Imlib_Image im, int dim, bool flip, int rot)
+{
+	int w, h;
+	bool alpha;
+	DATA32 *data;
+
+	imlib_context_set_image(im);
+	alpha = imlib_image_has_alpha();
+	data = tns_scale(imlib_image_get_data_for_reading_only(), imlib_image_get_width(),
+	                 imlib_image_get_height(), alpha, dim, flip, rot, &w, &h);
+	if (data != NULL) {
 		imlib_free_image_and_decache();
+		if ((im = img_from_data(data, w, h, alpha)) == NULL)
+			error(EXIT_FAILURE, ENOMEM, NULL);
 	}
 	return im;
 }
 
+/* thumbnails are kept at every zoom level up to the one above the current,
+ * so that zooming out and in by one level only switches between them. The
+ * missing level above is loaded again in the background, the lower ones are
+ * small enough to keep
+ */
+static int tns_top(const tns_t *tns)
+{
+	return MIN(tns->zl + 1, LEVELS - 1);
+}
+
+static bool tns_loaded(const tns_t *tns, const thumb_t *t)
+{
+	return t->im != NULL && t->levels[tns_top(tns)] != NULL;
+}
+
+/* scales the pixels of the cache size down to the zoom levels up to top */
+static void tns_scale_levels(const DATA32 *data, int w, int h, bool alpha,
+                             int top, DATA32 **levels, int *lw, int *lh)
+{
+	size_t size = (size_t) w * h * sizeof(DATA32);
+	int l;
+
+	for (l = 0; l <= top; l++) {
+		levels[l] = tns_scale(data, w, h, alpha, thumb_sizes[l], false, 0,
+		                      &lw[l], &lh[l]);
+		if (levels[l] == NULL) {
+			levels[l] = (DATA32*) emalloc(size);
+			memcpy(levels[l], data, size);
+			lw[l] = w;
+			lh[l] = h;
+		}
+	}
+}
+
+static void tns_free_levels(thumb_t *t, int l)
+{
+	for (; t->levels != NULL && l < LEVELS; l++) {
+		if (t->levels[l] != NULL) {
+			imlib_context_set_image(t->levels[l]);
+			imlib_free_image();
+			t->levels[l] = NULL;
+		}
+	}
+}
+
+/* makes the levels up to top the thumbnail of file n, they are taken over */
+static void tns_set_levels(tns_t *tns, int n, DATA32 **levels, const int *lw,
+                           const int *lh, bool alpha, int top)
+{
+	thumb_t *t = &tns->thumbs[n];
+	int l;
+
+	tns_unload(tns, n);
+	t->levels = (Imlib_Image*) emalloc(LEVELS * sizeof(Imlib_Image));
+	memset(t->levels, 0, LEVELS * sizeof(Imlib_Image));
+	for (l = 0; l <= top; l++) {
+		if ((t->levels[l] = img_from_data(levels[l], lw[l], lh[l], alpha)) == NULL)
+			error(EXIT_FAILURE, ENOMEM, NULL);
+		levels[l] = NULL;
+	}
+	t->im = t->levels[tns->zl];
+	t->w = lw[tns->zl];
+	t->h = lh[tns->zl];
+	if (!tns->dirty && n >= tns->first && n < tns->end)
+		tns_draw(tns, n);
+}
+
+/* makes im, which has the cache size, the thumbnail of file n */
+static void tns_set(tns_t *tns, int n, Imlib_Image im)
+{
+	DATA32 *levels[LEVELS];
+	int lw[LEVELS], lh[LEVELS];
+	bool alpha;
+
+	imlib_context_set_image(im);
+	alpha = imlib_image_has_alpha();
+	tns_scale_levels(imlib_image_get_data_for_reading_only(), imlib_image_get_width(),
+	                 imlib_image_get_height(), alpha, tns_top(tns), levels, lw, lh);
+	imlib_free_image_and_decache();
+	tns_set_levels(tns, n, levels, lw, lh, alpha, tns_top(tns));
+}
+
 bool tns_load(tns_t *tns, int n, bool force, bool cache_only)
 {
-	int maxwh = thumb_sizes[ARRLEN(thumb_sizes)-1];
-	bool cache_hit = false;
-	char *cfile;
+	int maxwh = thumb_sizes[ARRLEN(thumb_sizes)-1], rot;
+	bool cache_hit = false, flip;
 	thumb_t *t;
 	fileinfo_t *file;
 	Imlib_Image im = NULL;
@@ -241,124 +629,545 @@ bool tns_load(tns_t *tns, int n, bool force, bool cache_only)
 		return false;
 
 	t = &tns->thumbs[n];
-
-	if (t->im != NULL) {
-		imlib_context_set_image(t->im);
-		imlib_free_image();
-		t->im = NULL;
-	}
+	tns_unload(tns, n);
 
 	if (!force) {
 		if ((im = tns_cache_load(file->path, &force)) != NULL) {
-			imlib_context_set_image(im);
-			if (imlib_image_get_width() < maxwh &&
-			    imlib_image_get_height() < maxwh)
-			{
-				if ((cfile = tns_cache_filepath(file->path)) != NULL) {
-					unlink(cfile);
-					free(cfile);
-				}
-				imlib_free_image_and_decache();
-				im = NULL;
-			} else {
-				cache_hit = true;
-			}
+			cache_hit = true;
 #if HAVE_LIBEXIF
 		} else if (!force && !options->private_mode) {
-			int pw = 0, ph = 0, w, h, x = 0, y = 0;
-			bool err;
+			int pw, ph, w, h, x = 0, y = 0;
 			float zw, zh;
-			ExifData *ed;
-			ExifEntry *entry;
-			ExifContent *ifd;
-			ExifByteOrder byte_order;
-			int tmpfd;
-			char tmppath[] = "/tmp/swiv-XXXXXX";
 			Imlib_Image tmpim;
 
-			if ((ed = exif_data_new_from_file(file->path)) != NULL) {
-				if (ed->data != NULL && ed->size > 0 &&
-				    (tmpfd = mkstemp(tmppath)) >= 0)
-				{
-					err = write(tmpfd, ed->data, ed->size) != ed->size;
-					close(tmpfd);
-
-					if (!err && (tmpim = imlib_load_image(tmppath)) != NULL) {
-						byte_order = exif_data_get_byte_order(ed);
-						ifd = ed->ifd[EXIF_IFD_EXIF];
-						entry = exif_content_get_entry(ifd, EXIF_TAG_PIXEL_X_DIMENSION);
-						if (entry != NULL)
-							pw = exif_get_long(entry->data, byte_order);
-						entry = exif_content_get_entry(ifd, EXIF_TAG_PIXEL_Y_DIMENSION);
-						if (entry != NULL)
-							ph = exif_get_long(entry->data, byte_order);
-
-						imlib_context_set_image(tmpim);
-						w = imlib_image_get_width();
-						h = imlib_image_get_height();
-
-						if (pw > w && ph > h && (pw - ph >= 0) == (w - h >= 0)) {
-							zw = (float) pw / (float) w;
-							zh = (float) ph / (float) h;
-							if (zw < zh) {
-								pw /= zh;
-								x = (w - pw) / 2;
-								w = pw;
-							} else if (zw > zh) {
-								ph /= zw;
-								y = (h - ph) / 2;
-								h = ph;
-							}
-						}
-						if (w >= maxwh || h >= maxwh) {
-							if ((im = imlib_create_cropped_image(x, y, w, h)) == NULL)
-								error(EXIT_FAILURE, ENOMEM, NULL);
-						}
-						imlib_free_image_and_decache();
+			if ((tmpim = img_open_preview(file)) != NULL) {
+				/* the size of the image is known after the file is probed */
+				pw = file->meta.w;
+				ph = file->meta.h;
+				imlib_context_set_image(tmpim);
+				w = imlib_image_get_width();
+				h = imlib_image_get_height();
+
+				if (pw > w && ph > h && (pw - ph >= 0) == (w - h >= 0)) {
+					zw = (float) pw / (float) w;
+					zh = (float) ph / (float) h;
+					if (zw < zh) {
+						pw /= zh;
+						x = (w - pw) / 2;
+						w = pw;
+					} else if (zw > zh) {
+						ph /= zw;
+						y = (h - ph) / 2;
+						h = ph;
 					}
-					unlink(tmppath);
 				}
-				exif_data_unref(ed);
+				if (w >= maxwh || h >= maxwh) {
+					if ((im = imlib_create_cropped_image(x, y, w, h)) == NULL)
+						error(EXIT_FAILURE, ENOMEM, NULL);
+				}
+				imlib_free_image_and_decache();
 			}
 #endif
 		}
 	}
 
 	if (im == NULL) {
-		if ((im = img_open(file)) == NULL)
+		if ((im = img_open(file, maxwh, maxwh, NULL, NULL)) == NULL)
 			return false;
 	}
 	imlib_context_set_image(im);
 
 	if (!cache_hit) {
-#if HAVE_LIBEXIF
-		exif_auto_orientate(file);
-#endif
-		im = tns_scale_down(im, maxwh);
+		exif_orientation(file, &flip, &rot);
+		im = tns_scale_down(im, maxwh, flip, rot);
 		imlib_context_set_image(im);
 		if (imlib_image_get_width() == maxwh || imlib_image_get_height() == maxwh)
 			tns_cache_write(im, file->path, true);
 	}
 
-	if (cache_only) {
+	if (cache_only)
 		imlib_free_image_and_decache();
-	} else {
-		t->im = tns_scale_down(im, thumb_sizes[tns->zl]);
-		imlib_context_set_image(t->im);
-		t->w = imlib_image_get_width();
-		t->h = imlib_image_get_height();
-		tns->dirty = true;
-	}
+	else
+		tns_set(tns, n, im);
 	file->flags |= FF_TN_INIT;
 
 	if (n == tns->initnext)
 		while (++tns->initnext < *tns->cnt && ((++file)->flags & FF_TN_INIT));
 	if (n == tns->loadnext && !cache_only)
-		while (++tns->loadnext < tns->end && (++t)->im != NULL);
+		while (++tns->loadnext < tns->end && tns_loaded(tns, ++t));
 
 	return true;
 }
 
+/* loads the thumbnail of the job like tns_load(), but without imlib */
+static void tns_job_run(tns_job_t *job)
+{
+	int maxwh = thumb_sizes[ARRLEN(thumb_sizes)-1], w, h, rot;
+	bool cache_hit = false, outdated = false, flip;
+	DATA32 *data = NULL, *scaled;
+
+	if ((data = tns_cache_read(job->file.path, &w, &h, &job->alpha, &outdated)) != NULL)
+		cache_hit = true;
+#if HAVE_LIBEXIF && HAVE_LIBJPEG
+	if (data == NULL && !outdated && !options->private_mode &&
+	    (data = img_read_preview(&job->file, &w, &h)) != NULL)
+	{
+		int pw = job->file.meta.w, ph = job->file.meta.h, cw = w, ch = h;
+		int x = 0, y = 0, i;
+		float zw, zh;
+
+		/* crops the preview to the aspect ratio of the image like
+		 * tns_load()
+		 */
+		if (pw > w && ph > h && (pw - ph >= 0) == (w - h >= 0)) {
+			zw = (float) pw / (float) w;
+			zh = (float) ph / (float) h;
+			if (zw < zh) {
+				cw = pw / zh;
+				x = (w - cw) / 2;
+			} else if (zw > zh) {
+				ch = ph / zw;
+				y = (h - ch) / 2;
+			}
+		}
+		if (cw >= maxwh || ch >= maxwh) {
+			for (i = 0; i < ch; i++)
+				memmove(data + i * cw, data + (y + i) * w + x, cw * sizeof(DATA32));
+			w = cw;
+			h = ch;
+			job->alpha = false;
+		} else {
+			free(data);
+			data = NULL;
+		}
+	}
+#endif
+	if (data == NULL &&
+	    (data = img_read(&job->file, maxwh, maxwh, &w, &h, &job->alpha)) == NULL)
+	{
+		return;
+	}
+	if (!cache_hit) {
+		exif_orientation(&job->file, &flip, &rot);
+		if ((scaled = tns_scale(data, w, h, job->alpha, maxwh, flip, rot, &w, &h)) != NULL) {
+			free(data);
+			data = scaled;
+		}
+		if (w == maxwh || h == maxwh)
+			tns_cache_store(job->file.path, data, w, h, job->alpha, true);
+	}
+	if (job->top >= 0)
+		tns_scale_levels(data, w, h, job->alpha, job->top, job->levels, job->lw, job->lh);
+	job->data = data;
+	job->w = w;
+	job->h = h;
+}
+
+static void* tns_worker(void *arg)
+{
+	tns_job_t *job;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.todo == NULL)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		job = pool.todo;
+		pool.todo = job->next;
+		pthread_mutex_unlock(&pool.lock);
+
+		if (job->prio == PRIO_IMAGE) {
+			job->data = img_read(&job->file, job->bw, job->bh, &job->w, &job->h,
+			                     &job->alpha);
+		} else {
+			tns_job_run(job);
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		job->next = pool.done;
+		pool.done = job;
+		if (write(pool.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			error(0, errno, "eventfd");
+	}
+	return NULL;
+}
+
+/* starts the threads on the first call, returns false, if there are none */
+static bool tns_start(void)
+{
+	pthread_t t;
+	long n;
+
+	if (pool.cnt > 0 || pool.failed)
+		return pool.cnt > 0;
+
+	pool.failed = true;
+	if ((pool.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		error(0, errno, "eventfd");
+		return false;
+	}
+	n = THUMB_THREADS > 0 ? THUMB_THREADS : sysconf(_SC_NPROCESSORS_ONLN);
+	n = MIN(MAX(n, 1), MAX_THREADS);
+	for (; pool.cnt < n; pool.cnt++) {
+		if (pthread_create(&t, NULL, tns_worker, NULL) != 0)
+			break;
+		pthread_detach(t);
+	}
+	if (pool.cnt == 0) {
+		close(pool.fd);
+		pool.fd = -1;
+		return false;
+	}
+	pool.failed = false;
+	return true;
+}
+
+static jobprio_t tns_prio(const tns_t *tns, int n)
+{
+	if (n >= tns->first && n < tns->end)
+		return PRIO_VISIBLE;
+	else if (n >= tns->a_first && n < tns->a_end)
+		return PRIO_AHEAD;
+	else
+		return PRIO_CACHE;
+}
+
+/* only the thumbnails, which are kept, are scaled down to the zoom levels */
+static void tns_job_prio(const tns_t *tns, tns_job_t *job, int n)
+{
+	job->prio = tns_prio(tns, n);
+	job->top = job->prio != PRIO_CACHE ? tns_top(tns) : -1;
+}
+
+/* inserts the job after the ones with the same priority, pool.lock is held */
+static void tns_enqueue(tns_job_t *job)
+{
+	tns_job_t **p = &pool.todo;
+
+	while (*p != NULL && (*p)->prio <= job->prio)
+		p = &(*p)->next;
+	job->next = *p;
+	*p = job;
+}
+
+static void tns_push(tns_job_t *job)
+{
+	pool.pending++;
+	pthread_mutex_lock(&pool.lock);
+	tns_enqueue(job);
+	pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void tns_submit(tns_t *tns, int n)
+{
+	tns_job_t *job;
+
+	job = (tns_job_t*) emalloc(sizeof(tns_job_t));
+	memset(job, 0, sizeof(tns_job_t));
+	job->id = ++pool.id;
+	tns_job_prio(tns, job, n);
+	job->n = n;
+	job->file = tns->files[n];
+	job->file.path = job->file.name = estrdup(tns->files[n].path);
+	tns->thumbs[n].job = job->id;
+	tns_push(job);
+}
+
+/* queues the image of the file to be read for prefetching, within the box bw x
+ * bh like img_open(); returns the fd, which becomes readable, when it is done,
+ * or -1, if there are no threads
+ */
+int tns_read(const fileinfo_t *file, int bw, int bh)
+{
+	tns_job_t *job;
+
+	if (!tns_start())
+		return -1;
+
+	job = (tns_job_t*) emalloc(sizeof(tns_job_t));
+	memset(job, 0, sizeof(tns_job_t));
+	job->id = ++pool.id;
+	job->prio = PRIO_IMAGE;
+	job->top = -1;
+	job->n = -1;
+	job->file = *file;
+	job->file.path = job->file.name = estrdup(file->path);
+	job->bw = bw;
+	job->bh = bh;
+	tns_push(job);
+	return pool.fd;
+}
+
+static void tns_job_free(tns_job_t *job)
+{
+	int l;
+
+	free((void*) job->file.path);
+	free(job->data);
+	for (l = 0; l < LEVELS; l++)
+		free(job->levels[l]);
+	free(job);
+	pool.pending--;
+}
+
+/* drops the queued jobs, the running ones are dropped, when they are done */
+static void tns_cancel(void)
+{
+	tns_job_t *job, *next;
+
+	pthread_mutex_lock(&pool.lock);
+	job = pool.todo;
+	pool.todo = NULL;
+	pthread_mutex_unlock(&pool.lock);
+
+	for (; job != NULL; job = next) {
+		next = job->next;
+		tns_job_free(job);
+	}
+}
+
+/* the index of the file of the job, which is lower, if files before it were
+ * removed meanwhile, or -1, if it is gone
+ */
+static int tns_job_index(tns_t *tns, const tns_job_t *job)
+{
+	int n;
+
+	if (tns->thumbs == NULL)
+		return -1;
+	for (n = MIN(job->n, *tns->cnt - 1); n >= 0; n--) {
+		if (tns->thumbs[n].job == job->id)
+			return n;
+	}
+	return -1;
+}
+
+/* queues the next files to be loaded; the files left to the main thread, or
+ * all files without threads, are loaded one by every call; returns true, if it
+ * should be called again without waiting
+ */
+bool tns_schedule(tns_t *tns)
+{
+	tns_job_t *job;
+	thumb_t *t;
+	int n;
+
+	if (!tns_start()) {
+		if (tns->loadnext < tns->end) {
+			if (!tns_load(tns, tns->loadnext, false, false)) {
+				remove_file(tns->loadnext, false);
+				tns->dirty = true;
+			}
+			tns->win->redraw = true;
+		} else if (tns->initnext < *tns->cnt) {
+			if (!tns_load(tns, tns->initnext, false, true))
+				remove_file(tns->initnext, false);
+		}
+		return tns->loadnext < tns->end || tns->initnext < *tns->cnt;
+	}
+	tns->fd = pool.fd;
+
+	if ((job = pool.imlib) != NULL) {
+		pool.imlib = job->next;
+		if ((n = tns_job_index(tns, job)) >= 0) {
+			tns->thumbs[n].job = 0;
+			tns->files[n].meta = job->file.meta;
+			if (!tns_loaded(tns, &tns->thumbs[n]) &&
+			    !tns_load(tns, n, false, tns_prio(tns, n) == PRIO_CACHE))
+			{
+				remove_file(n, false);
+				tns->dirty = true;
+			}
+			if (tns_prio(tns, n) == PRIO_VISIBLE || tns->dirty)
+				tns->win->redraw = true;
+		}
+		tns_job_free(job);
+	}
+
+	/* enough jobs to keep the threads busy, until the main thread is woken;
+	 * the visible files first, then the rows ahead, then all the others
+	 */
+	n = tns->a_first;
+	while (pool.pending < 2 * pool.cnt) {
+		while (tns->loadnext < tns->end &&
+		       (tns_loaded(tns, t = &tns->thumbs[tns->loadnext]) || t->job != 0))
+		{
+			tns->loadnext++;
+		}
+		while (n < MIN(tns->a_end, *tns->cnt) &&
+		       (tns_loaded(tns, t = &tns->thumbs[n]) || t->job != 0))
+		{
+			n++;
+		}
+		while (tns->initnext < *tns->cnt &&
+		       ((tns->files[tns->initnext].flags & FF_TN_INIT) ||
+		        tns->thumbs[tns->initnext].job != 0))
+		{
+			tns->initnext++;
+		}
+		if (tns->loadnext < tns->end)
+			tns_submit(tns, tns->loadnext);
+		else if (n < MIN(tns->a_end, *tns->cnt))
+			tns_submit(tns, n);
+		else if (tns->initnext < *tns->cnt)
+			tns_submit(tns, tns->initnext);
+		else
+			break;
+	}
+	return pool.imlib != NULL;
+}
+
+/* after the view moved, the queued jobs get the priority of their new position;
+ * the ones for files, which are neither visible nor ahead anymore, are dropped,
+ * so that they do not delay the files, which came into view, and are queued
+ * again for caching later. Running jobs are not interrupted
+ */
+static void tns_requeue(tns_t *tns)
+{
+	tns_job_t *job, *next;
+	int n;
+
+	if (pool.cnt == 0)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	job = pool.todo;
+	pool.todo = NULL;
+	for (; job != NULL; job = next) {
+		next = job->next;
+		if (job->prio == PRIO_IMAGE) {
+			tns_enqueue(job);
+			continue;
+		}
+		n = tns_job_index(tns, job);
+		if (n >= 0)
+			tns_job_prio(tns, job, n);
+		if (n >= 0 && job->prio != PRIO_CACHE) {
+			tns_enqueue(job);
+		} else {
+			if (n >= 0) {
+				tns->thumbs[n].job = 0;
+				tns->initnext = MIN(tns->initnext, n);
+			}
+			tns_job_free(job);
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* moves the jobs, which are done, to the end of pool.thumbs and pool.images,
+ * in the order, in which they were done
+ */
+static void tns_drain(void)
+{
+	tns_job_t *job, *done = NULL, *next, **thumbs, **images;
+	uint64_t cnt;
+
+	if (pool.fd < 0 || read(pool.fd, &cnt, sizeof(cnt)) < 0)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	job = pool.done;
+	pool.done = NULL;
+	pthread_mutex_unlock(&pool.lock);
+
+	for (; job != NULL; job = next) {
+		next = job->next;
+		job->next = done;
+		done = job;
+	}
+	for (thumbs = &pool.thumbs; *thumbs != NULL; thumbs = &(*thumbs)->next);
+	for (images = &pool.images; *images != NULL; images = &(*images)->next);
+	for (job = done; job != NULL; job = next) {
+		next = job->next;
+		job->next = NULL;
+		if (job->prio == PRIO_IMAGE) {
+			*images = job;
+			images = &job->next;
+		} else {
+			*thumbs = job;
+			thumbs = &job->next;
+		}
+	}
+}
+
+/* takes the next image, which was read for prefetching, returns false, if there
+ * is none; the path of file is owned by the caller, data is NULL, if the image
+ * could not be read
+ */
+bool tns_read_done(fileinfo_t *file, DATA32 **data, int *w, int *h, bool *alpha)
+{
+	tns_job_t *job;
+
+	tns_drain();
+	if ((job = pool.images) == NULL)
+		return false;
+	pool.images = job->next;
+
+	*file = job->file;
+	*data = job->data;
+	*w = job->w;
+	*h = job->h;
+	*alpha = job->alpha;
+	job->file.path = NULL;
+	job->data = NULL;
+	tns_job_free(job);
+	return true;
+}
+
+/* takes over the thumbnails loaded by the threads, returns true, if the window
+ * needs to be redrawn
+ */
+bool tns_collect(tns_t *tns)
+{
+	tns_job_t *job, *next, **imlib;
+	fileinfo_t *file;
+	bool keep, redraw = false;
+	int l, n;
+
+	tns_drain();
+	job = pool.thumbs;
+	pool.thumbs = NULL;
+
+	for (; job != NULL; job = next) {
+		next = job->next;
+		if ((n = tns_job_index(tns, job)) < 0) {
+			tns_job_free(job);
+			continue;
+		}
+		if (job->data == NULL) {
+			for (imlib = &pool.imlib; *imlib != NULL; imlib = &(*imlib)->next);
+			job->next = NULL;
+			*imlib = job;
+			continue;
+		}
+		file = &tns->files[n];
+		tns->thumbs[n].job = 0;
+		file->meta = job->file.meta;
+		keep = tns_prio(tns, n) != PRIO_CACHE && !tns_loaded(tns, &tns->thumbs[n]);
+
+		if (keep) {
+			/* it was queued for caching or before zooming in */
+			if (job->top < tns_top(tns)) {
+				for (l = 0; l <= job->top; l++) {
+					free(job->levels[l]);
+					job->levels[l] = NULL;
+				}
+				job->top = tns_top(tns);
+				tns_scale_levels(job->data, job->w, job->h, job->alpha, job->top,
+				                 job->levels, job->lw, job->lh);
+			}
+			tns_set_levels(tns, n, job->levels, job->lw, job->lh, job->alpha,
+			               job->top);
+		}
+		file->flags |= FF_TN_INIT;
+		redraw = redraw || tns_prio(tns, n) == PRIO_VISIBLE;
+		tns_job_free(job);
+	}
+	return redraw;
+}
+
 void tns_unload(tns_t *tns, int n)
 {
 	thumb_t *t;
@@ -368,9 +1177,10 @@ void tns_unload(tns_t *tns, int n)
 
 	t = &tns->thumbs[n];
 
-	if (t->im != NULL) {
-		imlib_context_set_image(t->im);
-		imlib_free_image();
+	if (t->levels != NULL) {
+		tns_free_levels(t, 0);
+		free(t->levels);
+		t->levels = NULL;
 		t->im = NULL;
 	}
 }
@@ -403,11 +1213,36 @@ void tns_check_view(tns_t *tns, bool scrolled)
 	}
 }
 
+/* draws thumbnail n into its cell of the grid, which was laid out by the
+ * last tns_render(), only the cell is damaged
+ */
+static void tns_draw(tns_t *tns, int n)
+{
+	win_t *win = tns->win;
+	thumb_t *t = &tns->thumbs[n];
+	int x, y;
+
+	x = tns->x + (n - tns->first) % tns->cols * tns->dim;
+	y = tns->y + (n - tns->first) / tns->cols * tns->dim;
+	win_draw_rect(win, x - tns->bw - 3, y - tns->bw - 3, tns->dim, tns->dim,
+	              true, 1, win->bg);
+
+	t->x = x + (thumb_sizes[tns->zl] - t->w) / 2;
+	t->y = y + (thumb_sizes[tns->zl] - t->h) / 2;
+	imlib_context_set_image(t->im);
+	win_render_imlib_image_at_size(win, t->x, t->y, t->w, t->h, THUMB_FILTER);
+
+	if (n == *tns->sel)
+		tns_highlight(tns, n, true);
+	else if (tns->files[n].flags & FF_MARK)
+		tns_mark(tns, n, true);
+}
+
 void tns_render(tns_t *tns)
 {
-	thumb_t *t;
 	win_t *win;
-	int i, cnt, r, x, y;
+	int i, cnt, r, x, y, a_first, a_end;
+	bool moved;
 
 	if (!tns->dirty)
 		return;
@@ -435,34 +1270,37 @@ void tns_render(tns_t *tns)
 	tns->loadnext = *tns->cnt;
 	tns->end = tns->first + cnt;
 
-	for (i = tns->r_first; i < tns->r_end; i++) {
-		if ((i < tns->first || i >= tns->end) && tns->thumbs[i].im != NULL)
+	/* the thumbnails of THUMB_AHEAD rows after the visible ones in scroll
+	 * direction are kept as well
+	 */
+	if (tns->first != tns->r_first)
+		tns->dir = tns->first > tns->r_first ? 1 : -1;
+	r = THUMB_AHEAD * tns->cols;
+	a_first = tns->dir < 0 ? MAX(tns->first - r, 0) : tns->end;
+	a_end = tns->dir < 0 ? tns->first : MIN(tns->end + r, *tns->cnt);
+
+	for (i = MIN(tns->r_first, tns->a_first); i < MAX(tns->r_end, tns->a_end); i++) {
+		if ((i < MIN(tns->first, a_first) || i >= MAX(tns->end, a_end)) &&
+		    i < *tns->cnt && tns->thumbs[i].im != NULL)
+		{
 			tns_unload(tns, i);
+		}
 	}
+	moved = tns->first != tns->r_first || tns->end != tns->r_end;
 	tns->r_first = tns->first;
 	tns->r_end = tns->end;
+	tns->a_first = a_first;
+	tns->a_end = a_end;
+	if (moved)
+		tns_requeue(tns);
 
 	for (i = tns->first; i < tns->end; i++) {
-		t = &tns->thumbs[i];
-		if (t->im != NULL) {
-			t->x = x + (thumb_sizes[tns->zl] - t->w) / 2;
-			t->y = y + (thumb_sizes[tns->zl] - t->h) / 2;
-			imlib_context_set_image(t->im);
-			win_render_imlib_image_at_size(win, t->x, t->y, t->w, t->h);
-			if (tns->files[i].flags & FF_MARK)
-				tns_mark(tns, i, true);
-		} else {
+		if (tns->thumbs[i].im != NULL)
+			tns_draw(tns, i);
+		if (!tns_loaded(tns, &tns->thumbs[i]))
 			tns->loadnext = MIN(tns->loadnext, i);
-		}
-		if ((i + 1) % tns->cols == 0) {
-			x = tns->x;
-			y += tns->dim;
-		} else {
-			x += tns->dim;
-		}
 	}
 	tns->dirty = false;
-	tns_highlight(tns, *tns->sel, true);
 }
 
 void tns_mark(tns_t *tns, int n, bool mark)
@@ -563,6 +1401,7 @@ bool tns_scroll(tns_t *tns, direction_t dir, bool screen)
 bool tns_zoom(tns_t *tns, int d)
 {
 	int i, oldzl;
+	thumb_t *t;
 
 	oldzl = tns->zl;
 	tns->zl += -(d < 0) + (d > 0);
@@ -574,8 +1413,20 @@ bool tns_zoom(tns_t *tns, int d)
 	tns->dim = thumb_sizes[tns->zl] + 2 * tns->bw + 6;
 
 	if (tns->zl != oldzl) {
-		for (i = 0; i < *tns->cnt; i++)
-			tns_unload(tns, i);
+		for (i = 0; i < *tns->cnt; i++) {
+			t = &tns->thumbs[i];
+			if (t->im == NULL)
+				continue;
+			if (t->levels[tns->zl] == NULL) {
+				tns_unload(tns, i);
+				continue;
+			}
+			tns_free_levels(t, tns_top(tns) + 1);
+			t->im = t->levels[tns->zl];
+			imlib_context_set_image(t->im);
+			t->w = imlib_image_get_width();
+			t->h = imlib_image_get_height();
+		}
 		tns->dirty = true;
 	}
 	return tns->zl != oldzl;
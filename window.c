@@ -60,6 +60,27 @@ static struct {
 
 static int barheight;
 
+static win_buf_t* win_back(win_t*, bool);
+
+/* the pixels of the window buffer for direct access, stride is set to the
+ * number of pixels per row; keep has to be set, unless the whole window is
+ * drawn. win_put_back_data() has to be called afterwards
+ */
+uint32_t* win_get_data(win_t *win, int *stride, bool keep)
+{
+	win_buf_t *buf = win_back(win, keep);
+	cairo_surface_t *surf = cairo_get_target(buf->cr);
+
+	cairo_surface_flush(surf);
+	*stride = cairo_image_surface_get_stride(surf) / 4;
+	return (uint32_t*) buf->data;
+}
+
+void win_put_back_data(win_t *win)
+{
+	cairo_surface_mark_dirty(cairo_get_target(win->buffer->cr));
+}
+
 void win_render_imlib_image(win_t *win, int x, int y)
 {
 	uint32_t *img_data = imlib_image_get_data_for_reading_only();
@@ -74,25 +95,54 @@ void win_render_imlib_image(win_t *win, int x, int y)
 		error(EXIT_FAILURE, 0, "error: cairo surface: %s",
 				cairo_status_to_string(status));
 
-	cairo_set_source_surface(win->buffer.cr, img_surf, x, y);
-	cairo_paint(win->buffer.cr);
+	cairo_t *cr = win_back(win, true)->cr;
+	cairo_set_source_surface(cr, img_surf, x, y);
+	cairo_paint(cr);
+	win_damage(win, x, y, img_w, img_h);
 
 	cairo_surface_destroy(img_surf);
 }
 
-void win_render_imlib_image_at_size(win_t *win, int x, int y, int w, int h)
-{
-	Imlib_Image saved_img = imlib_context_get_image();
-	Imlib_Image img = imlib_create_cropped_scaled_image(0, 0, imlib_image_get_width(), imlib_image_get_height(), w, h);
-	if (img == NULL)
-		error(EXIT_FAILURE, 0, "error: failed to scale image");
-
-	imlib_context_set_image(img);
+/* scales the current imlib image straight into the window buffer, blended
+ * onto the window background
+ */
+void win_render_imlib_image_at_size(win_t *win, int x, int y, int w, int h,
+                                    filter_t filter)
+{
+	render_src_t src;
+	render_dst_t dst;
+	uint32_t bg;
+
+	src.data = imlib_image_get_data_for_reading_only();
+	src.w = imlib_image_get_width();
+	src.h = imlib_image_get_height();
+	src.alpha = imlib_image_has_alpha();
+	src.flip = false;
+	src.rot = 0;
+	src.x = x;
+	src.y = y;
+	src.zx = (float) w / src.w;
+	src.zy = (float) h / src.h;
+
+	dst.x = MAX(x, 0);
+	dst.y = MAX(y, 0);
+	dst.w = MIN(x + w, win->width) - dst.x;
+	dst.h = MIN(y + h, win->height) - dst.y;
+	if (dst.w <= 0 || dst.h <= 0)
+		return;
 
-	win_render_imlib_image(win, x, y);
+	bg = 0xFF000000 | (uint32_t) (win->bg.r * 255 + 0.5) << 16 |
+	     (uint32_t) (win->bg.g * 255 + 0.5) << 8 | (uint32_t) (win->bg.b * 255 + 0.5);
+	dst.bg[0] = dst.bg[1] = bg;
+	dst.bgx = dst.bgy = 0;
+	dst.lut = NULL;
+	dst.filter = src.zx == 1.0 && src.zy == 1.0 ? FILTER_NEAREST : filter;
+	dst.blend = true;
 
-	imlib_free_image();
-	imlib_context_set_image(saved_img);
+	dst.data = win_get_data(win, &dst.stride, true);
+	render_image(&dst, &src);
+	win_put_back_data(win);
+	win_damage(win, dst.x, dst.y, dst.w, dst.h);
 }
 
 static void pointer_handle_enter(void *data, struct wl_pointer *wl_pointer,
@@ -304,12 +354,22 @@ static void free_buffer(win_buf_t *buf)
 	buf->layout = NULL;
 	cairo_destroy(buf->cr);
 	buf->cr = NULL;
+	buf->busy = false;
+}
+
+static void buffer_handle_release(void *data, struct wl_buffer *wl_buf)
+{
+	win_buf_t *buf = data;
+	buf->busy = false;
 }
 
-static win_buf_t new_buffer(int width, int height, struct wl_shm *shm,
-		PangoFontDescription *font_desc)
+static const struct wl_buffer_listener buffer_listener = {
+	.release = buffer_handle_release,
+};
+
+static void new_buffer(win_buf_t *buf, int width, int height,
+		struct wl_shm *shm, PangoFontDescription *font_desc)
 {
-	win_buf_t buf = {0};
 	int stride = width * 4;
 	int shm_pool_size = height * stride;
 
@@ -337,31 +397,114 @@ static win_buf_t new_buffer(int width, int height, struct wl_shm *shm,
 		error(EXIT_FAILURE, errno, "error: failed to create wl_buffer");
 	}
 	wl_shm_pool_destroy(pool);
-
-	buf.fd = fd;
-	buf.wl_buf = buffer;
-	buf.data = pool_data;
-	buf.data_size = shm_pool_size;
+	wl_buffer_add_listener(buffer, &buffer_listener, buf);
+
+	buf->fd = fd;
+	buf->wl_buf = buffer;
+	buf->data = pool_data;
+	buf->data_size = shm_pool_size;
+	buf->width = width;
+	buf->height = height;
+	buf->busy = false;
+	buf->stale.rects[0] = (win_rect_t) { 0, 0, width, height };
+	buf->stale.cnt = 1;
 
 	cairo_surface_t *cr_surf = cairo_image_surface_create_for_data(
-			(unsigned char *)buf.data, CAIRO_FORMAT_ARGB32, width,
+			(unsigned char *)buf->data, CAIRO_FORMAT_ARGB32, width,
 			height, 4 * width);
 	cairo_status_t status = cairo_surface_status(cr_surf);
 	if (status != CAIRO_STATUS_SUCCESS) {
 		error(EXIT_FAILURE, 0, "error: cairo surface: %s",
 				cairo_status_to_string(status));
 	}
-	buf.cr = cairo_create(cr_surf);
-	status = cairo_status(buf.cr);
+	buf->cr = cairo_create(cr_surf);
+	status = cairo_status(buf->cr);
 	cairo_surface_destroy(cr_surf);
 	if (status != CAIRO_STATUS_SUCCESS) {
 		error(EXIT_FAILURE, 0, "error: cairo: %s",
 				cairo_status_to_string(status));
 	}
 
-	buf.layout = pango_cairo_create_layout(buf.cr);
-	pango_layout_set_font_description(buf.layout, font_desc);
-	return buf;
+	buf->layout = pango_cairo_create_layout(buf->cr);
+	pango_layout_set_font_description(buf->layout, font_desc);
+}
+
+static void region_add(win_region_t *rg, int x, int y, int w, int h)
+{
+	win_rect_t *r;
+	int i, x1, y1;
+
+	if (w <= 0 || h <= 0)
+		return;
+
+	/* overlapping or adjacent rectangles are merged */
+	for (i = 0; i < rg->cnt; i++) {
+		r = &rg->rects[i];
+		if (x <= r->x + r->w && r->x <= x + w && y <= r->y + r->h && r->y <= y + h) {
+			x1 = MAX(x + w, r->x + r->w);
+			y1 = MAX(y + h, r->y + r->h);
+			x = MIN(x, r->x);
+			y = MIN(y, r->y);
+			w = x1 - x;
+			h = y1 - y;
+			rg->rects[i] = rg->rects[--rg->cnt];
+			i = -1;
+		}
+	}
+	if (rg->cnt == WIN_RECTS) {
+		for (i = 0; i < rg->cnt; i++) {
+			r = &rg->rects[i];
+			x1 = MAX(x + w, r->x + r->w);
+			y1 = MAX(y + h, r->y + r->h);
+			x = MIN(x, r->x);
+			y = MIN(y, r->y);
+			w = x1 - x;
+			h = y1 - y;
+		}
+		rg->cnt = 0;
+	}
+	rg->rects[rg->cnt++] = (win_rect_t) { x, y, w, h };
+}
+
+/* the buffer to draw into: the last committed one may still be read by the
+ * compositor, so drawing continues in a released one, in which the areas
+ * changed since it was committed itself are updated from the committed one,
+ * if keep is set. Only when all buffers are in use, the committed one is
+ * drawn into.
+ */
+static win_buf_t* win_back(win_t *win, bool keep)
+{
+	win_buf_t *buf = NULL;
+	win_rect_t *r;
+	int i, y, stride;
+
+	if (!win->buffer->busy)
+		return win->buffer;
+
+	for (i = 0; i < WIN_BUFFERS && buf == NULL; i++) {
+		if (win->buffers[i].data != NULL && !win->buffers[i].busy)
+			buf = &win->buffers[i];
+	}
+	for (i = 0; i < WIN_BUFFERS && buf == NULL; i++) {
+		if (win->buffers[i].data == NULL) {
+			buf = &win->buffers[i];
+			new_buffer(buf, win->buffer->width, win->buffer->height,
+					win->shm, win->font_desc);
+		}
+	}
+	if (buf == NULL)
+		return win->buffer;
+
+	for (i = 0; keep && i < buf->stale.cnt; i++) {
+		r = &buf->stale.rects[i];
+		stride = buf->width * 4;
+		for (y = r->y; y < r->y + r->h; y++) {
+			memcpy(buf->data + y * stride + r->x * 4,
+			       win->buffer->data + y * stride + r->x * 4, r->w * 4);
+		}
+	}
+	buf->stale.cnt = 0;
+	return win->buffer = buf;
 }
 
 static void xdg_toplevel_handle_configure(void *data,
@@ -470,10 +613,11 @@ void win_init(win_t *win)
 
 	xres_unload();
 
-	win->buffer = new_buffer(win->width, win->height, win->shm, win->font_desc);
+	win->buffer = &win->buffers[0];
+	new_buffer(win->buffer, win->width, win->height, win->shm, win->font_desc);
 
 	int fontheight;
-	pango_layout_get_pixel_size(win->buffer.layout, NULL, &fontheight);
+	pango_layout_get_pixel_size(win->buffer->layout, NULL, &fontheight);
 	barheight = fontheight + 2 * V_TEXT_PAD;
 
 
@@ -639,9 +783,8 @@ void win_open(win_t *win)
 	struct wl_callback *cb = wl_surface_frame(win->surface);
 	wl_callback_add_listener(cb, &wl_surface_frame_listener, win);
 
-	wl_surface_attach(win->surface, win->buffer.wl_buf, 0, 0);
-	wl_surface_damage_buffer(win->surface, 0, 0, UINT32_MAX, UINT32_MAX);
-	wl_surface_commit(win->surface);
+	win_damage(win, 0, 0, win->buffer->width, win->buffer->height);
+	win_commit(win);
 
 	cb = wl_surface_frame(win->pointer.surface);
 	wl_callback_add_listener(cb, &cursor_callback_listener, win);
@@ -649,6 +792,8 @@ void win_open(win_t *win)
 
 CLEANUP void win_close(win_t *win)
 {
+	int i;
+
 	if (win->top_decor)
 		zxdg_toplevel_decoration_v1_destroy(win->top_decor);
 	if (win->decor_manager)
@@ -664,7 +809,8 @@ CLEANUP void win_close(win_t *win)
 	pango_font_description_free(win->font_desc);
 	wl_cursor_theme_destroy(win->pointer.theme);
 	wl_surface_destroy(win->pointer.surface);
-	free_buffer(&win->buffer);
+	for (i = 0; i < WIN_BUFFERS; i++)
+		free_buffer(&win->buffers[i]);
 	xdg_toplevel_destroy(win->xdg_toplevel);
 	xdg_surface_destroy(win->xdg_surface);
 	xdg_wm_base_destroy(win->xdg_wm_base);
@@ -695,12 +841,13 @@ void win_toggle_bar(win_t *win)
 
 void win_clear(win_t *win)
 {
-	cairo_t *cr = win->buffer.cr;
+	cairo_t *cr = win_back(win, false)->cr;
 	cairo_save(cr);
 	cairo_set_source_rgba(cr, win->bg.r, win->bg.g, win->bg.b, win->bg.a);
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	cairo_paint(cr);
 	cairo_restore(cr);
+	win_damage(win, 0, 0, win->buffer->width, win->buffer->height);
 }
 
 #define TEXTWIDTH(win, text, len) \
@@ -727,7 +874,7 @@ static void win_draw_bar(win_t *win)
 {
 	int len, x, y, w, tw;
 	win_bar_t *l, *r;
-	win_buf_t *buf = &win->buffer;
+	win_buf_t *buf = win_back(win, true);
 
 	if ((l = &win->bar.l)->buf == NULL || (r = &win->bar.r)->buf == NULL)
 		return;
@@ -738,6 +885,7 @@ static void win_draw_bar(win_t *win)
 	cairo_set_source_rgba(buf->cr, win->fg.r, win->fg.g, win->fg.b, win->fg.a);
 	cairo_rectangle(buf->cr, 0, win->height, win->width, win->bar.h);
 	cairo_fill(buf->cr);
+	win_damage(win, 0, win->height, win->width, win->bar.h);
 
 	if ((len = strlen(r->buf)) > 0) {
 		if ((tw = TEXTWIDTH(buf, r->buf, len)) > w)
@@ -758,9 +906,52 @@ static void win_draw_bar(win_t *win)
 
 void win_recreate_buffer(win_t *win)
 {
-	free_buffer(&win->buffer);
-	win->buffer = new_buffer(win->width, win->height + win->bar.h,
+	int i;
+
+	for (i = 0; i < WIN_BUFFERS; i++)
+		free_buffer(&win->buffers[i]);
+	win->buffer = &win->buffers[0];
+	new_buffer(win->buffer, win->width, win->height + win->bar.h,
 			win->shm, win->font_desc);
+	win->damage.cnt = 0;
+}
+
+void win_damage(win_t *win, int x, int y, int w, int h)
+{
+	int x1 = MIN(x + w, win->buffer->width);
+	int y1 = MIN(y + h, win->buffer->height);
+
+	x = MAX(x, 0);
+	y = MAX(y, 0);
+	region_add(&win->damage, x, y, x1 - x, y1 - y);
+}
+
+/* attaches the buffer, which was drawn into, only the damaged areas are
+ * passed to the compositor and updated in the other buffers, before they
+ * are drawn into. The compositor reads the buffer until it is released
+ */
+void win_commit(win_t *win)
+{
+	win_rect_t *r;
+	int i, j;
+
+	if (win->damage.cnt == 0) {
+		wl_surface_commit(win->surface);
+		return;
+	}
+	wl_surface_attach(win->surface, win->buffer->wl_buf, 0, 0);
+	for (i = 0; i < win->damage.cnt; i++) {
+		r = &win->damage.rects[i];
+		wl_surface_damage_buffer(win->surface, r->x, r->y, r->w, r->h);
+		for (j = 0; j < WIN_BUFFERS; j++) {
+			if (&win->buffers[j] != win->buffer && win->buffers[j].data != NULL)
+				region_add(&win->buffers[j].stale, r->x, r->y, r->w, r->h);
+		}
+	}
+	wl_surface_commit(win->surface);
+	win->buffer->busy = true;
+	win->buffer->stale.cnt = 0;
+	win->damage.cnt = 0;
 }
 
 void win_draw(win_t *win)
@@ -774,10 +965,11 @@ void win_draw(win_t *win)
 void win_draw_rect(win_t *win, int x, int y, int w, int h, bool fill, int lw,
 		color_t col)
 {
-	cairo_t *cr = win->buffer.cr;
+	cairo_t *cr = win_back(win, true)->cr;
 	cairo_set_source_rgba(cr, col.r, col.g, col.b, col.a);
 	cairo_set_line_width(cr, lw);
 	cairo_rectangle(cr, x, y, w, h);
+	win_damage(win, x - lw, y - lw, w + 2 * lw, h + 2 * lw);
 
 	if (fill)
 		cairo_fill(cr);